@@ -0,0 +1,486 @@
+#include <iostream>
+#include <vector>
+#include <string>
+#include <string.h>
+#include <stdlib.h>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+#include <map>
+#include "nbody.h"
+#include "solvers.h"
+#include "trajectory.h"
+
+using namespace std;
+
+//One timed configuration, also what a line of the JSON output holds
+struct BenchResult
+{
+	string engine;
+	string distribution;
+	int bodies = 0;
+	string precision;
+	int threads = 0;
+	int steps = 0;
+	double secondsPerStep = 0;
+	double interactionsPerSecond = 0;
+	size_t memoryBytes = 0;
+};
+
+struct BenchOptions
+{
+	vector<string> engines;
+	vector<string> distributions;
+	vector<string> precisions;
+	vector<int> threads;
+	int minBodies = 1000;
+	int maxBodies = 10000000;
+	uint64_t seed = 12345;
+	//Skip any configuration whose predicted step time is above this many seconds
+	double budget = 5;
+	//Keep stepping until this much time has been measured, or maxSteps steps have run
+	double minSeconds = .5;
+	int maxSteps = 10;
+	string output;
+	string compare;
+	string input;
+	//A result this much slower than its baseline is a regression
+	double tolerance = .1;
+	//Trajectory compression modes to time instead of the solvers
+	vector<string> codecs;
+	double codecError = 1e-3;
+	int codecFrames = 16;
+	string codecPath = "bench_trajectory.nbt";
+};
+
+//One compression mode on one recorded run, also what a line of the JSON output holds
+struct CodecResult
+{
+	string codec;
+	string distribution;
+	int bodies = 0;
+	int frames = 0;
+	double ratio = 0;
+	double writeBytesPerSecond = 0;
+	double readBytesPerSecond = 0;
+	double maxError = 0;
+};
+
+vector<string> splitList(const string& list)
+{
+	vector<string> items;
+	stringstream stream(list);
+	string item;
+	while (getline(stream, item, ','))
+		if (item.size() > 0)
+			items.push_back(item);
+	return items;
+}
+
+//Same densities as the fields the simulator's hotkeys make at 40000 bodies, so per step costs are what it would see
+//The fields are seeded so every run benchmarks the same bodies
+vector<nbody> makeBenchField(const string& distribution, int massCount, uint64_t seed)
+{
+	vector<nbody> field;
+	double scale = sqrt(massCount/40000.0);
+	if (distribution == "disk")
+		makeAccDisk(massCount, 7200*scale, 200000, 0, 0, seed, &field);
+	else if (distribution == "plummer")
+		makePlummer(massCount, 720*scale, 7200*scale, 0, 0, 0, 0, seed, &field);
+	else if (distribution == "expdisk")
+		makeExponentialDisk(massCount, 1440*scale, .15, massCount/4, 0, 0, 0, 0, 1, seed, &field);
+	else if (distribution == "galaxies")
+		makeGalaxyCollision(massCount, 720*scale, 8640*scale, 0, 0, seed, &field);
+	else
+		placeRandomField(massCount, 5, 7200*scale, 0, 0, seed, &field);
+	return field;
+}
+
+//Runs one warm-up step, then steps until enough time has been measured
+BenchResult runBench(ForceSolver* solver, const string& distribution, int bodies, const string& precision, int threads, const BenchOptions& options)
+{
+	using namespace std::chrono;
+	BenchResult result;
+	result.engine = solver->getName();
+	result.distribution = distribution;
+	result.bodies = bodies;
+	result.precision = precision;
+	result.threads = threads;
+
+	vector<nbody> nbodyList = makeBenchField(distribution, bodies, options.seed);
+	solver->singlePrecision = precision == "single";
+	maxThreads = threads;
+
+	double total = 0;
+	for (int s=0;s<=options.maxSteps && (s <= 1 || total < options.minSeconds);s++)
+	{
+		steady_clock::time_point start = steady_clock::now();
+		solver->step(&nbodyList);
+		double seconds = duration<double>(steady_clock::now() - start).count();
+
+		//Merged bodies are removed between steps like the simulator does, that isn't part of the step time
+		nbodyList.erase(remove_if(nbodyList.begin(), nbodyList.end(), [](const nbody& curBody) { return curBody.dead; }), nbodyList.end());
+
+		//The first step pays for thread startup, buffer allocation and the first kernel launch
+		if (s == 0)
+			continue;
+		total += seconds;
+		result.steps++;
+	}
+
+	result.secondsPerStep = total/max(result.steps, 1);
+	//Counted as direct summation would, so the tree's number is the direct rate it is equivalent to
+	result.interactionsPerSecond = (double)bodies*(bodies - 1)/max(result.secondsPerStep, 1e-12);
+	result.memoryBytes = sizeof(nbody)*bodies + solver->memoryBytes;
+	return result;
+}
+
+//Records options.codecFrames steps of a run with every mode in turn, the same steps for each, and reads them back
+//Throughput is in uncompressed bytes, so every mode is measured against what a raw write of the same steps moves
+vector<CodecResult> runCodecBench(ForceSolver* solver, const string& distribution, int bodies, const BenchOptions& options)
+{
+	using namespace std::chrono;
+	vector<vector<nbody>> frames;
+	vector<nbody> nbodyList = makeBenchField(distribution, bodies, options.seed);
+	for (int f=0;f<options.codecFrames;f++)
+	{
+		frames.push_back(nbodyList);
+		solver->step(&nbodyList);
+	}
+
+	vector<CodecResult> results;
+	for (int c=0;c<options.codecs.size();c++)
+	{
+		int mode = getCompressionMode(options.codecs[c]);
+		if (mode < 0)
+		{
+			std::cout << "Unknown compression " << options.codecs[c] << "\n";
+			continue;
+		}
+
+		CodecResult result;
+		result.codec = options.codecs[c];
+		result.distribution = distribution;
+		result.bodies = bodies;
+		result.frames = frames.size();
+
+		TrajectoryWriter writer;
+		writer.setCompression(mode, options.codecError);
+		steady_clock::time_point start = steady_clock::now();
+		if (!writer.open(options.codecPath))
+			break;
+		for (int f=0;f<frames.size();f++)
+			writer.writeFrame(frames[f], f);
+		writer.close();
+		double writeSeconds = duration<double>(steady_clock::now() - start).count();
+		result.ratio = (double)writer.rawBytes/max(writer.bytesWritten, (uint64_t)1);
+		result.writeBytesPerSecond = writer.rawBytes/max(writeSeconds, 1e-9);
+
+		TrajectoryReader reader;
+		TrajectoryFrame frame;
+		start = steady_clock::now();
+		reader.open(options.codecPath);
+		for (int f=0;f<reader.getFrameCount();f++)
+			reader.readFrame(f, &frame);
+		double readSeconds = duration<double>(steady_clock::now() - start).count();
+		result.readBytesPerSecond = writer.rawBytes/max(readSeconds, 1e-9);
+
+		//Checked on the last step, its bodies are all still in frames in the order they were written
+		int i = 0;
+		for (int b=0;b<frames.back().size();b++)
+			if (!frames.back()[b].dead && i < frame.x.size())
+			{
+				result.maxError = max(result.maxError, max(fabs(frame.x[i] - frames.back()[b].x), fabs(frame.y[i] - frames.back()[b].y)));
+				result.maxError = max(result.maxError, max(fabs(frame.velX[i] - frames.back()[b].velX), fabs(frame.velY[i] - frames.back()[b].velY)));
+				i++;
+			}
+		results.push_back(result);
+	}
+	remove(options.codecPath.c_str());
+	return results;
+}
+
+string codecResultToJson(const CodecResult& result)
+{
+	ostringstream line;
+	line.precision(9);
+	line << "{\"codec\": \"" << result.codec << "\", \"distribution\": \"" << result.distribution << "\", \"bodies\": " << result.bodies
+		<< ", \"frames\": " << result.frames << ", \"ratio\": " << result.ratio << ", \"writeBytesPerSecond\": " << result.writeBytesPerSecond
+		<< ", \"readBytesPerSecond\": " << result.readBytesPerSecond << ", \"maxError\": " << result.maxError << "}";
+	return line.str();
+}
+
+string getResultKey(const BenchResult& result)
+{
+	return result.engine + "/" + result.distribution + "/" + to_string(result.bodies) + "/" + result.precision + "/" + to_string(result.threads);
+}
+
+string resultToJson(const BenchResult& result)
+{
+	ostringstream line;
+	line.precision(9);
+	line << "{\"engine\": \"" << result.engine << "\", \"distribution\": \"" << result.distribution << "\", \"bodies\": " << result.bodies
+		<< ", \"precision\": \"" << result.precision << "\", \"threads\": " << result.threads << ", \"steps\": " << result.steps
+		<< ", \"secondsPerStep\": " << result.secondsPerStep << ", \"interactionsPerSecond\": " << result.interactionsPerSecond
+		<< ", \"memoryBytes\": " << result.memoryBytes << "}";
+	return line.str();
+}
+
+//Only has to read back what resultToJson writes, one result object per line
+string getJsonField(const string& line, const string& name)
+{
+	size_t start = line.find("\"" + name + "\":");
+	if (start == string::npos)
+		return "";
+	start = line.find_first_not_of(" \"", start + name.size() + 3);
+	size_t stop = line.find_first_of(",}\"", start);
+	if (start == string::npos || stop == string::npos)
+		return "";
+	return line.substr(start, stop - start);
+}
+
+vector<BenchResult> readResults(const string& path)
+{
+	vector<BenchResult> results;
+	ifstream f;
+	f.open(path, ios::in);
+	if (!f.is_open())
+	{
+		std::cout << "Couldn't open " << path << "\n";
+		return results;
+	}
+
+	string line;
+	while (getline(f, line))
+	{
+		if (getJsonField(line, "engine") == "")
+			continue;
+
+		BenchResult result;
+		result.engine = getJsonField(line, "engine");
+		result.distribution = getJsonField(line, "distribution");
+		result.bodies = atoi(getJsonField(line, "bodies").c_str());
+		result.precision = getJsonField(line, "precision");
+		result.threads = atoi(getJsonField(line, "threads").c_str());
+		result.steps = atoi(getJsonField(line, "steps").c_str());
+		result.secondsPerStep = atof(getJsonField(line, "secondsPerStep").c_str());
+		result.interactionsPerSecond = atof(getJsonField(line, "interactionsPerSecond").c_str());
+		result.memoryBytes = strtoull(getJsonField(line, "memoryBytes").c_str(), NULL, 10);
+		results.push_back(result);
+	}
+
+	return results;
+}
+
+void writeResults(const string& path, const vector<BenchResult>& results)
+{
+	ofstream f;
+	f.open(path, ios::out);
+	f << "[\n";
+	for (int r=0;r<results.size();r++)
+		f << "\t" << resultToJson(results[r]) << (r < results.size()-1 ? ",\n" : "\n");
+	f << "]\n";
+}
+
+//Prints every configuration found in both runs and returns how many got slower by more than the tolerance
+int compareResults(const vector<BenchResult>& baseline, const vector<BenchResult>& results, double tolerance)
+{
+	map<string, BenchResult> baselineByKey;
+	for (int r=0;r<baseline.size();r++)
+		baselineByKey[getResultKey(baseline[r])] = baseline[r];
+
+	int regressions = 0;
+	for (int r=0;r<results.size();r++)
+	{
+		string key = getResultKey(results[r]);
+		if (!baselineByKey.count(key))
+			continue;
+
+		double before = baselineByKey[key].secondsPerStep;
+		double after = results[r].secondsPerStep;
+		double change = before > 0 ? after/before - 1 : 0;
+		bool regressed = change > tolerance;
+		if (regressed)
+			regressions++;
+
+		std::cout << (regressed ? "REGRESSION " : "ok         ") << key << ": " << before*1000 << " ms -> " << after*1000 << " ms (" << (change >= 0 ? "+" : "") << change*100 << "%)\n";
+	}
+
+	std::cout << regressions << " regression(s) beyond " << tolerance*100 << "%\n";
+	return regressions;
+}
+
+void printUsage()
+{
+	std::cout << "Usage: bench [options]\n"
+		<< "  --engines=opencl,cpu,tree   engines to time (default: every available one)\n"
+		<< "  --min=1000 --max=10000000   body counts, stepping by factors of 10\n"
+		<< "  --precision=double,single   precisions to time\n"
+		<< "  --threads=1,4               CPU thread counts to time (default: every hardware thread)\n"
+		<< "  --distributions=uniform,disk,plummer,expdisk,galaxies\n"
+		<< "  --budget=5                  skip configurations predicted to take longer than this many seconds per step\n"
+		<< "  --seed=12345                seed for the initial conditions\n"
+		<< "  --output=results.json       write the results as JSON\n"
+		<< "  --compare=baseline.json     flag results slower than the baseline by more than --tolerance=0.1\n"
+		<< "  --input=results.json        compare a saved run instead of running one\n"
+		<< "  --codecs=none,xor,quantized time trajectory compression instead of the solvers, on steps from the first engine\n"
+		<< "  --codec-error=0.001         largest error quantized compression may add\n"
+		<< "  --codec-frames=16           steps recorded per run\n";
+}
+
+int main(int argc, char** argv)
+{
+	BenchOptions options;
+	options.engines = splitList("opencl,cpu,tree");
+	options.distributions = splitList("uniform,disk,plummer,expdisk,galaxies");
+	options.precisions = splitList("double,single");
+	options.threads.push_back(0);
+
+	for (int i=1;i<argc;i++)
+	{
+		string arg = argv[i];
+		size_t split = arg.find('=');
+		string name = arg.substr(0, split);
+		string value = split == string::npos ? "" : arg.substr(split + 1);
+
+		if (name == "--engines")
+			options.engines = splitList(value);
+		else if (name == "--distributions")
+			options.distributions = splitList(value);
+		else if (name == "--precision")
+			options.precisions = splitList(value);
+		else if (name == "--threads")
+		{
+			options.threads.clear();
+			vector<string> threads = splitList(value);
+			for (int t=0;t<threads.size();t++)
+				options.threads.push_back(atoi(threads[t].c_str()));
+		}
+		else if (name == "--min")
+			options.minBodies = atof(value.c_str());
+		else if (name == "--max")
+			options.maxBodies = atof(value.c_str());
+		else if (name == "--budget")
+			options.budget = atof(value.c_str());
+		else if (name == "--seed")
+			options.seed = strtoull(value.c_str(), NULL, 10);
+		else if (name == "--output")
+			options.output = value;
+		else if (name == "--compare")
+			options.compare = value;
+		else if (name == "--input")
+			options.input = value;
+		else if (name == "--tolerance")
+			options.tolerance = atof(value.c_str());
+		else if (name == "--codecs")
+			options.codecs = splitList(value);
+		else if (name == "--codec-error")
+			options.codecError = atof(value.c_str());
+		else if (name == "--codec-frames")
+			options.codecFrames = max(1, atoi(value.c_str()));
+		else
+		{
+			printUsage();
+			return 1;
+		}
+	}
+
+	vector<BenchResult> results;
+	if (options.input.size() > 0)
+		results = readResults(options.input);
+	else
+	{
+		ClEngine engine;
+		CpuSolver cpuSolver;
+		TreeSolver treeSolver;
+		vector<ForceSolver*> solvers;
+		for (int e=0;e<options.engines.size();e++)
+		{
+			if (options.engines[e] == "opencl" && engine.init())
+				solvers.push_back(&engine);
+			else if (options.engines[e] == "cpu")
+				solvers.push_back(&cpuSolver);
+			else if (options.engines[e] == "tree")
+				solvers.push_back(&treeSolver);
+		}
+
+		//Compression is timed on steps from the first engine asked for, skipping body counts whose steps would go over budget
+		if (options.codecs.size() > 0 && solvers.size() > 0)
+		{
+			vector<CodecResult> codecResults;
+			for (int d=0;d<options.distributions.size();d++)
+			{
+				SolverCalibration measured;
+				for (long long n=options.minBodies; n<=options.maxBodies; n*=10)
+				{
+					double predicted = measured.predict(n)*options.codecFrames;
+					if (predicted > options.budget)
+					{
+						std::cout << "Skipping " << options.distributions[d] << " " << n << ": predicted " << predicted << " s of stepping\n";
+						break;
+					}
+
+					chrono::steady_clock::time_point start = chrono::steady_clock::now();
+					vector<CodecResult> run = runCodecBench(solvers[0], options.distributions[d], n, options);
+					for (int r=0;r<run.size();r++)
+						std::cout << codecResultToJson(run[r]) << "\n";
+					codecResults.insert(codecResults.end(), run.begin(), run.end());
+
+					measured.counts.push_back(n);
+					measured.seconds.push_back(max(chrono::duration<double>(chrono::steady_clock::now() - start).count()/options.codecFrames, 1e-9));
+				}
+			}
+
+			if (options.output.size() > 0)
+			{
+				ofstream f;
+				f.open(options.output, ios::out);
+				f << "[\n";
+				for (int r=0;r<codecResults.size();r++)
+					f << "\t" << codecResultToJson(codecResults[r]) << (r < codecResults.size()-1 ? ",\n" : "\n");
+				f << "]\n";
+			}
+			return 0;
+		}
+
+		for (int s=0;s<solvers.size();s++)
+		{
+			ForceSolver* solver = solvers[s];
+			//OpenCL devices schedule their own work, the thread count only applies to the CPU solvers
+			vector<int> threads = solver->initializesInBackground() ? vector<int>(1, 0) : options.threads;
+			for (int d=0;d<options.distributions.size();d++)
+				for (int p=0;p<options.precisions.size();p++)
+					for (int t=0;t<threads.size();t++)
+					{
+						//Step times measured so far in this sweep predict the next one, once it is over budget larger N can only be worse
+						SolverCalibration measured;
+						for (long long n=options.minBodies; n<=options.maxBodies; n*=10)
+						{
+							double predicted = measured.predict(n);
+							if (predicted > options.budget)
+							{
+								std::cout << "Skipping " << solver->getName() << " " << options.distributions[d] << " " << n << " " << options.precisions[p] << ": predicted " << predicted << " s per step\n";
+								break;
+							}
+
+							BenchResult result = runBench(solver, options.distributions[d], n, options.precisions[p], threads[t], options);
+							if (result.threads == 0 && !solver->initializesInBackground())
+								result.threads = getThreadCount();
+							std::cout << resultToJson(result) << "\n";
+							results.push_back(result);
+
+							measured.counts.push_back(n);
+							measured.seconds.push_back(max(result.secondsPerStep, 1e-9));
+						}
+					}
+		}
+	}
+
+	if (options.output.size() > 0)
+		writeResults(options.output, results);
+
+	if (options.compare.size() > 0 && compareResults(readResults(options.compare), results, options.tolerance) > 0)
+		return 1;
+
+	return 0;
+}
@@ -1,3 +1,5 @@
-g++ nbody.cpp -lSDL2 -std=c++11
+g++ nbody.cpp -lSDL2 -std=c++11 -pthread
+g++ bench.cpp -lOpenCL -std=c++11 -pthread -O2 -o bench
 
-g++ nbody.cpp -I. -L. -lSDL2_ttf -lSDL2main -lSDL2 C:\Windows\System32\OpenCL.dll -std=c++11 -o main.exe -w
\ No newline at end of file
+g++ nbody.cpp -I. -L. -lSDL2_ttf -lSDL2main -lSDL2 -lwinmm C:\Windows\System32\OpenCL.dll -std=c++11 -o main.exe -w
+g++ bench.cpp -I. C:\Windows\System32\OpenCL.dll -std=c++11 -O2 -o bench.exe -w
\ No newline at end of file
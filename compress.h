@@ -0,0 +1,428 @@
+#ifndef COMPRESS_H
+#define COMPRESS_H
+
+#include <vector>
+#include <string>
+#include <unordered_map>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include "nbody.h"
+
+using namespace std;
+
+//How frame columns are stored
+//XOR is lossless: each double is XORed with the same body's value in the previous frame and only the bytes that changed are kept
+//Quantized rounds to a grid of twice maxError, so every value comes back within maxError of what was written, and codes the
+//difference from where the body's last two frames say it should be. Smooth motion then costs a byte or two per value
+enum
+{
+	COMPRESSION_NONE = 0,
+	COMPRESSION_XOR = 1,
+	COMPRESSION_QUANTIZED = 2
+};
+
+//x, y, velX and velY, what trajectories store
+const int frameColumns = 4;
+
+string getCompressionName(int mode)
+{
+	string names[] = {"none", "xor", "quantized"};
+	return mode >= 0 && mode <= 2 ? names[mode] : "unknown";
+}
+
+int getCompressionMode(const string& name)
+{
+	for (int mode=COMPRESSION_NONE;mode<=COMPRESSION_QUANTIZED;mode++)
+		if (getCompressionName(mode) == name)
+			return mode;
+	return -1;
+}
+
+//The put functions write at out and return where they stopped, callers make room for the most they can write
+//A varint takes at most 10 bytes, a value from putXor at most 9
+const int maxVarintBytes = 10;
+
+inline char* putVarint(char* out, uint64_t value)
+{
+	while (value >= 0x80)
+	{
+		*out++ = (char)(value | 0x80);
+		value >>= 7;
+	}
+	*out++ = (char)value;
+	return out;
+}
+
+inline bool getVarint(const char** data, const char* end, uint64_t* value)
+{
+	*value = 0;
+	for (int shift=0;shift<64 && *data < end;shift+=7)
+	{
+		uint8_t byte = *(*data)++;
+		*value |= (uint64_t)(byte & 0x7F) << shift;
+		if (!(byte & 0x80))
+			return true;
+	}
+	return false;
+}
+
+//Small negative and positive numbers both become small unsigned ones
+inline uint64_t zigzag(uint64_t value)
+{
+	return (value << 1) ^ (uint64_t)((int64_t)value >> 63);
+}
+
+inline uint64_t unzigzag(uint64_t value)
+{
+	return (value >> 1) ^ (0 - (value & 1));
+}
+
+//One byte holding how many of the 8 bytes are zero at the top and at the bottom, then the bytes in between
+inline char* putXor(char* out, uint64_t value)
+{
+	if (value == 0)
+	{
+		*out++ = (char)0x80;
+		return out;
+	}
+
+	int leading = __builtin_clzll(value)/8;
+	int trailing = __builtin_ctzll(value)/8;
+	*out++ = (char)(leading << 4 | trailing);
+	value >>= 8*trailing;
+	for (int b=0;b<8 - leading - trailing;b++)
+	{
+		*out++ = (char)value;
+		value >>= 8;
+	}
+	return out;
+}
+
+inline bool getXor(const char** data, const char* end, uint64_t* value)
+{
+	if (*data >= end)
+		return false;
+	uint8_t header = *(*data)++;
+	int leading = header >> 4;
+	int trailing = header & 15;
+	*value = 0;
+	if (leading == 8)
+		return true;
+	int bytes = 8 - leading - trailing;
+	if (bytes <= 0 || end - *data < bytes)
+		return false;
+	for (int b=0;b<bytes;b++)
+		*value |= (uint64_t)(uint8_t)(*data)[b] << 8*(trailing + b);
+	*data += bytes;
+	return true;
+}
+
+//Per body values the next frame is predicted from, the encoder and decoder keep identical copies
+struct FrameHistory
+{
+	vector<uint32_t> ids;
+	//XOR: the bits of the last value of each column. Quantized: the last quantized value
+	vector<vector<uint64_t>> values;
+	//Quantized only: how much each quantized value changed between the last two frames
+	vector<vector<uint64_t>> changes;
+	unordered_map<uint32_t, int> lookup;
+
+	void clear()
+	{
+		this->ids.clear();
+		this->values.clear();
+		this->changes.clear();
+		this->lookup.clear();
+	}
+
+	//Sized for a frame of count bodies, the values have to be filled in
+	void prepare(const uint32_t* newIds, int count, int columnCount, bool quantized)
+	{
+		this->ids.assign(newIds, newIds + count);
+		this->values.resize(columnCount);
+		this->changes.resize(columnCount);
+		for (int c=0;c<columnCount;c++)
+		{
+			this->values[c].resize(count);
+			this->changes[c].resize(quantized ? count : 0);
+		}
+	}
+
+	//Index of each body of a new frame in this one, or -1 if it is new
+	//Bodies keep their order between frames, so walking both lists together finds nearly all of them without the hash map
+	void match(const uint32_t* newIds, int count, vector<int>* matches)
+	{
+		matches->resize(count);
+		int p = 0;
+		int n = this->ids.size();
+		for (int i=0;i<count;i++)
+		{
+			while (p < n && this->ids[p] != newIds[i] && this->ids[p] < newIds[i])
+				p++;
+			if (p < n && this->ids[p] == newIds[i])
+			{
+				(*matches)[i] = p++;
+				continue;
+			}
+
+			if (this->lookup.size() == 0 && n > 0)
+				for (int j=0;j<n;j++)
+					this->lookup[this->ids[j]] = j;
+			unordered_map<uint32_t, int>::iterator it = this->lookup.find(newIds[i]);
+			(*matches)[i] = it != this->lookup.end() ? it->second : -1;
+		}
+	}
+};
+
+//Encodes frames of ids and columnCount columns of doubles, x, y, velX, velY for trajectories, against the frames before them
+//A keyframe forgets the history, so decoding can start from it
+//Each frame is split into one segment per thread that are coded in parallel, a segment predicts bodies that are new
+//from the body before them in the same segment
+class FrameCodec
+{
+public:
+	int mode = COMPRESSION_XOR;
+	double maxError = 0;
+	int columnCount = frameColumns;
+	FrameHistory history;
+
+	FrameCodec(int argMode = COMPRESSION_XOR, double argMaxError = 0, int argColumnCount = frameColumns)
+	{
+		this->mode = argMode;
+		this->maxError = argMaxError;
+		this->columnCount = argColumnCount;
+	}
+
+	void reset()
+	{
+		this->history.clear();
+	}
+
+	//Payload: double maxError, uint32 segment count, uint32 mode, then {uint32 first body, uint32 bodies, uint64 bytes} per segment
+	//and the segments. A segment is its bodies' ids as varint differences, then each column's values in turn
+	void encode(const uint32_t* ids, const double* const* columns, int count, bool keyframe, vector<char>* out)
+	{
+		if (keyframe)
+			this->reset();
+
+		vector<int> matches;
+		this->history.match(ids, count, &matches);
+		FrameHistory next;
+		next.prepare(ids, count, this->columnCount, this->mode == COMPRESSION_QUANTIZED);
+		bool hasHistory = this->history.values.size() == this->columnCount;
+
+		double grid = 2*this->maxError;
+		int segmentCount = getParallelChunkCount(count);
+		vector<vector<char>> segments(segmentCount);
+		vector<int> segmentStart(segmentCount);
+		vector<int> segmentStop(segmentCount);
+		parallelFor(count, [&](int s, int start, int stop)
+		{
+			vector<char>& segment = segments[s];
+			segmentStart[s] = start;
+			segmentStop[s] = stop;
+			segment.resize((size_t)(stop - start)*maxVarintBytes*(1 + this->columnCount));
+			char* at = segment.data();
+
+			uint32_t lastId = 0;
+			for (int i=start;i<stop;i++)
+			{
+				at = putVarint(at, zigzag((uint64_t)ids[i] - lastId));
+				lastId = ids[i];
+			}
+
+			for (int c=0;c<this->columnCount;c++)
+			{
+				const double* column = columns[c];
+				const uint64_t* lastValues = hasHistory ? this->history.values[c].data() : NULL;
+				const uint64_t* lastChanges = hasHistory ? this->history.changes[c].data() : NULL;
+				uint64_t previous = 0;
+				for (int i=start;i<stop;i++)
+				{
+					int m = hasHistory ? matches[i] : -1;
+					if (this->mode == COMPRESSION_QUANTIZED)
+					{
+						uint64_t value = quantize(column[i], grid);
+						uint64_t predicted = m >= 0 ? lastValues[m] + lastChanges[m] : previous;
+						at = putVarint(at, zigzag(value - predicted));
+						next.values[c][i] = value;
+						next.changes[c][i] = m >= 0 ? value - lastValues[m] : 0;
+						previous = value;
+					}
+					else
+					{
+						uint64_t bits;
+						memcpy(&bits, &column[i], 8);
+						at = putXor(at, bits ^ (m >= 0 ? lastValues[m] : previous));
+						next.values[c][i] = bits;
+						previous = bits;
+					}
+				}
+			}
+			segment.resize(at - segment.data());
+		});
+
+		uint32_t segmentCount32 = segmentCount;
+		uint32_t mode32 = this->mode;
+		out->clear();
+		out->resize(16 + 16*segmentCount);
+		memcpy(out->data(), &this->maxError, 8);
+		memcpy(out->data() + 8, &segmentCount32, 4);
+		memcpy(out->data() + 12, &mode32, 4);
+		for (int s=0;s<segmentCount;s++)
+		{
+			uint32_t first = segmentStart[s];
+			uint32_t bodies = segmentStop[s] - segmentStart[s];
+			uint64_t bytes = segments[s].size();
+			memcpy(out->data() + 16 + 16*s, &first, 4);
+			memcpy(out->data() + 20 + 16*s, &bodies, 4);
+			memcpy(out->data() + 24 + 16*s, &bytes, 8);
+		}
+		for (int s=0;s<segmentCount;s++)
+			out->insert(out->end(), segments[s].begin(), segments[s].end());
+
+		swap(this->history, next);
+	}
+
+	//Decodes a payload from encode into count ids and columns, frames have to be decoded in the order they were encoded
+	bool decode(const char* data, size_t bytes, int count, bool keyframe, uint32_t* ids, double* const* columns)
+	{
+		if (keyframe)
+			this->reset();
+		if (bytes < 16)
+			return false;
+
+		uint32_t segmentCount, mode32;
+		memcpy(&this->maxError, data, 8);
+		memcpy(&segmentCount, data + 8, 4);
+		memcpy(&mode32, data + 12, 4);
+		this->mode = mode32;
+		if (bytes < 16 + 16*(uint64_t)segmentCount)
+			return false;
+
+		//Segment bounds are checked before any thread touches them
+		vector<const char*> segmentData(segmentCount);
+		vector<const char*> segmentEnd(segmentCount);
+		vector<int> segmentStart(segmentCount);
+		vector<int> segmentStop(segmentCount);
+		const char* at = data + 16 + 16*segmentCount;
+		int expected = 0;
+		for (int s=0;s<segmentCount;s++)
+		{
+			uint32_t first, bodies;
+			uint64_t segmentBytes;
+			memcpy(&first, data + 16 + 16*s, 4);
+			memcpy(&bodies, data + 20 + 16*s, 4);
+			memcpy(&segmentBytes, data + 24 + 16*s, 8);
+			if (first != expected || bodies > count - first || segmentBytes > (uint64_t)(data + bytes - at))
+				return false;
+			segmentData[s] = at;
+			segmentEnd[s] = at + segmentBytes;
+			segmentStart[s] = first;
+			segmentStop[s] = first + bodies;
+			expected += bodies;
+			at += segmentBytes;
+		}
+		if (expected != count)
+			return false;
+
+		//Ids come first so every body can be matched to the last frame before the columns are decoded
+		vector<char> failed(segmentCount, 0);
+		runSegments(segmentCount, [&](int s)
+		{
+			uint32_t lastId = 0;
+			for (int i=segmentStart[s];i<segmentStop[s];i++)
+			{
+				uint64_t difference;
+				if (!getVarint(&segmentData[s], segmentEnd[s], &difference))
+				{
+					failed[s] = 1;
+					return;
+				}
+				lastId += (uint32_t)unzigzag(difference);
+				ids[i] = lastId;
+			}
+		});
+		for (int s=0;s<segmentCount;s++)
+			if (failed[s])
+				return false;
+
+		vector<int> matches;
+		this->history.match(ids, count, &matches);
+		FrameHistory next;
+		next.prepare(ids, count, this->columnCount, this->mode == COMPRESSION_QUANTIZED);
+		bool hasHistory = this->history.values.size() == this->columnCount;
+
+		double grid = 2*this->maxError;
+		runSegments(segmentCount, [&](int s)
+		{
+			for (int c=0;c<this->columnCount;c++)
+			{
+				double* column = columns[c];
+				const uint64_t* lastValues = hasHistory ? this->history.values[c].data() : NULL;
+				const uint64_t* lastChanges = hasHistory ? this->history.changes[c].data() : NULL;
+				uint64_t previous = 0;
+				for (int i=segmentStart[s];i<segmentStop[s];i++)
+				{
+					int m = hasHistory ? matches[i] : -1;
+					uint64_t coded;
+					if (this->mode == COMPRESSION_QUANTIZED)
+					{
+						if (!getVarint(&segmentData[s], segmentEnd[s], &coded))
+						{
+							failed[s] = 1;
+							return;
+						}
+						uint64_t predicted = m >= 0 ? lastValues[m] + lastChanges[m] : previous;
+						uint64_t value = predicted + unzigzag(coded);
+						column[i] = (double)(int64_t)value*grid;
+						next.values[c][i] = value;
+						next.changes[c][i] = m >= 0 ? value - lastValues[m] : 0;
+						previous = value;
+					}
+					else
+					{
+						if (!getXor(&segmentData[s], segmentEnd[s], &coded))
+						{
+							failed[s] = 1;
+							return;
+						}
+						uint64_t bits = coded ^ (m >= 0 ? lastValues[m] : previous);
+						memcpy(&column[i], &bits, 8);
+						next.values[c][i] = bits;
+						previous = bits;
+					}
+				}
+			}
+		});
+		for (int s=0;s<segmentCount;s++)
+			if (failed[s])
+				return false;
+
+		swap(this->history, next);
+		return true;
+	}
+
+	//Values past 2^62 grid steps are clamped, which only happens with a maxError far too small for the field
+	static uint64_t quantize(double value, double grid)
+	{
+		double steps = grid > 0 ? value/grid : 0;
+		const double limit = 4611686018427387904.0;
+		steps = max(-limit, min(limit, steps));
+		return (uint64_t)(int64_t)llround(steps);
+	}
+
+private:
+	//The decoder's segments come from the file, so they are spread over threads one at a time rather than through parallelFor's split
+	static void runSegments(int segmentCount, function<void(int)> fn)
+	{
+		parallelFor(segmentCount, [&](int chunk, int start, int stop)
+		{
+			for (int s=start;s<stop;s++)
+				fn(s);
+		});
+	}
+};
+
+#endif
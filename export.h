@@ -0,0 +1,600 @@
+#ifndef EXPORT_H
+#define EXPORT_H
+
+#include <iostream>
+#include <vector>
+#include <deque>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <memory>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "nbody.h"
+#include "render.h"
+
+using namespace std;
+
+enum ExportStyle
+{
+	//Outlines, velocity lines and shaded points like the window draws
+	EXPORT_OUTLINE,
+	//The density map
+	EXPORT_DENSITY
+};
+
+string getExportStyleName(int style)
+{
+	return style == EXPORT_DENSITY ? "density" : "outline";
+}
+
+//-1 if name isn't a style
+int getExportStyle(const string& name)
+{
+	if (name == "outline")
+		return EXPORT_OUTLINE;
+	if (name == "density")
+		return EXPORT_DENSITY;
+	return -1;
+}
+
+//A view of width by height pixels showing all of the rectangle from minX, minY to maxX, maxY, centered, with the
+//same scale both ways so nothing is stretched
+ViewTransform getRegionView(int width, int height, double minX, double minY, double maxX, double maxY)
+{
+	ViewTransform view;
+	view.width = width;
+	view.height = height;
+	view.scale = min(width/max(maxX - minX, 1e-9), height/max(maxY - minY, 1e-9));
+	view.cameraOffsetX = (minX + maxX)/2 - (double)width/2;
+	view.cameraOffsetY = (minY + maxY)/2 - (double)height/2;
+	view.rootScale = false;
+	return view;
+}
+
+//The box around the live bodies with margin added on every side as a fraction of its size
+bool getBodyBounds(const vector<nbody>& list, double margin, double* minX, double* minY, double* maxX, double* maxY)
+{
+	*minX = INFINITY;
+	*minY = INFINITY;
+	*maxX = -INFINITY;
+	*maxY = -INFINITY;
+	for (int i=0;i<list.size();i++)
+	{
+		if (list[i].dead)
+			continue;
+		*minX = min(*minX, list[i].x - list[i].radius);
+		*minY = min(*minY, list[i].y - list[i].radius);
+		*maxX = max(*maxX, list[i].x + list[i].radius);
+		*maxY = max(*maxY, list[i].y + list[i].radius);
+	}
+	if (*minX > *maxX)
+		return false;
+	double padX = (*maxX - *minX)*margin;
+	double padY = (*maxY - *minY)*margin;
+	*minX -= padX;
+	*maxX += padX;
+	*minY -= padY;
+	*maxY += padY;
+	return true;
+}
+
+//The printf pattern numbered frame files are written with. One %d or %0Nd in path numbers the frames, a path without one
+//gets 6 digits before its extension, and every other % is escaped so it's kept as it is. False if path has more than one
+bool getFramePattern(const string& path, string* pattern)
+{
+	string numbered = path;
+	size_t conversion = string::npos;
+	size_t conversionLength = 0;
+	for (size_t i=0;i<path.size();i++)
+	{
+		if (path[i] != '%')
+			continue;
+		//Zero padding to at most 2 digits, nothing else printf understands is let through
+		size_t end = i + 1;
+		if (end < path.size() && path[end] == '0')
+		{
+			end++;
+			while (end < path.size() && end - i <= 3 && path[end] >= '0' && path[end] <= '9')
+				end++;
+		}
+		if (end < path.size() && path[end] == 'd')
+		{
+			if (conversion != string::npos)
+				return false;
+			conversion = i;
+			conversionLength = end + 1 - i;
+			i = end;
+		}
+	}
+	if (conversion == string::npos)
+	{
+		size_t dot = path.find_last_of('.');
+		size_t slash = path.find_last_of("/\\");
+		bool hasExtension = dot != string::npos && (slash == string::npos || dot > slash);
+		conversion = hasExtension ? dot : path.size();
+		conversionLength = 4;
+		numbered = path.substr(0, conversion) + "%06d" + (hasExtension ? path.substr(dot) : ".ppm");
+	}
+
+	pattern->clear();
+	for (size_t i=0;i<numbered.size();i++)
+	{
+		if (i == conversion)
+		{
+			pattern->append(numbered, i, conversionLength);
+			i += conversionLength - 1;
+		}
+		else if (numbered[i] == '%')
+			pattern->append("%%");
+		else
+			pattern->push_back(numbered[i]);
+	}
+	return true;
+}
+
+//Draws bodies into an RGBA buffer in memory, without a window or renderer, at any size
+//Bodies are projected in parallel, then each thread draws a band of rows, clipping everything to its band so no two
+//threads write the same pixel and the image comes out the same whatever the thread count
+//Memory grows with the frame, not the threads: the density style adds one float a pixel shared by every band
+class FrameRasterizer
+{
+public:
+	int style = EXPORT_OUTLINE;
+	//Bodies with a smaller radius on screen than this are drawn as points
+	double pointRadius = 1;
+	//Outline segments for the biggest bodies, more than the window uses since frames can be far bigger
+	int maxCircleSegments = 64;
+
+	int width = 0;
+	int height = 0;
+	//Four bytes a pixel, red, green, blue and alpha, rows top to bottom
+	vector<uint8_t> pixels;
+
+	void draw(const vector<nbody>& nbodyList, const ViewTransform& view)
+	{
+		this->width = max(view.width, 0);
+		this->height = max(view.height, 0);
+		this->pixels.resize((size_t)this->width*this->height*4);
+		if (this->width == 0 || this->height == 0)
+			return;
+		if (this->style == EXPORT_DENSITY)
+			this->drawDensity(nbodyList, view);
+		else
+			this->drawOutlines(nbodyList, view);
+	}
+
+private:
+	struct Circle
+	{
+		double x;
+		double y;
+		double radius;
+		int segments;
+		//Screen offset of the end of its velocity line, 0 for none
+		double velX;
+		double velY;
+	};
+
+	unique_ptr<atomic<uint32_t>[]> pixelCounts;
+	size_t pixelCount = 0;
+	vector<vector<Circle>> circles;
+	DensityRenderer density;
+
+	void setPixel(int x, int y, const uint8_t color[3])
+	{
+		uint8_t* pixel = &this->pixels[((size_t)y*this->width + x)*4];
+		pixel[0] = color[0];
+		pixel[1] = color[1];
+		pixel[2] = color[2];
+		pixel[3] = 0xFF;
+	}
+
+	//Draws the part of the line from (x0, y0) to (x1, y1) that is within rows top to bottom - 1
+	void drawLine(double x0, double y0, double x1, double y1, int top, int bottom, const uint8_t color[3])
+	{
+		//Clipped to the band first so a line far longer than the frame costs no more than one across it
+		double t0 = 0, t1 = 1;
+		double dx = x1 - x0;
+		double dy = y1 - y0;
+		double p[4] = {-dx, dx, -dy, dy};
+		double q[4] = {x0, this->width - x0, y0 - top, bottom - y0};
+		for (int k=0;k<4;k++)
+		{
+			if (p[k] == 0)
+			{
+				if (q[k] < 0)
+					return;
+				continue;
+			}
+			double t = q[k]/p[k];
+			if (p[k] < 0)
+				t0 = max(t0, t);
+			else
+				t1 = min(t1, t);
+		}
+		if (t0 > t1)
+			return;
+
+		double startX = x0 + dx*t0, startY = y0 + dy*t0;
+		double endX = x0 + dx*t1, endY = y0 + dy*t1;
+		int steps = (int)ceil(max(fabs(endX - startX), fabs(endY - startY)));
+		for (int s=0;s<=steps;s++)
+		{
+			double t = steps > 0 ? (double)s/steps : 0;
+			int x = (int)floor(startX + (endX - startX)*t);
+			int y = (int)floor(startY + (endY - startY)*t);
+			if (x >= 0 && x < this->width && y >= top && y < bottom)
+				this->setPixel(x, y, color);
+		}
+	}
+
+	void drawOutlines(const vector<nbody>& nbodyList, const ViewTransform& view)
+	{
+		int width = this->width;
+		int height = this->height;
+		if ((size_t)width*height != this->pixelCount)
+		{
+			this->pixelCount = (size_t)width*height;
+			this->pixelCounts.reset(new atomic<uint32_t>[this->pixelCount]);
+		}
+		atomic<uint32_t>* counts = this->pixelCounts.get();
+		//Split by rows, a big enough frame has more pixels than an int holds
+		parallelFor(height, [&](int chunk, int start, int stop)
+		{
+			for (size_t p=(size_t)start*width;p<(size_t)stop*width;p++)
+				counts[p].store(0, memory_order_relaxed);
+		});
+
+		int n = nbodyList.size();
+		int chunkCount = getParallelChunkCount(n);
+		this->circles.resize(chunkCount);
+		parallelFor(n, [&](int chunk, int start, int stop)
+		{
+			vector<Circle>& chunkCircles = this->circles[chunk];
+			chunkCircles.clear();
+			for (int i=start;i<stop;i++)
+			{
+				const nbody& curBody = nbodyList[i];
+				if (curBody.dead)
+					continue;
+
+				double x, y, radius;
+				view.project(curBody, &x, &y, &radius);
+				if (radius < this->pointRadius)
+				{
+					if (x >= 0 && y >= 0 && x < width && y < height)
+						counts[(size_t)y*width + (int)x].fetch_add(1, memory_order_relaxed);
+					continue;
+				}
+
+				Circle circle;
+				circle.x = x;
+				circle.y = y;
+				circle.radius = radius;
+				circle.segments = max(6, min(this->maxCircleSegments, (int)(radius*2)));
+				circle.velX = view.rootScale ? 0 : curBody.velX;
+				circle.velY = view.rootScale ? 0 : curBody.velY;
+				if (x + max(radius, circle.velX) < 0 || x + min(-radius, circle.velX) >= width || y + max(radius, circle.velY) < 0 || y + min(-radius, circle.velY) >= height)
+					continue;
+				chunkCircles.push_back(circle);
+			}
+		});
+
+		//Same colors and order as the window: shaded points, then red velocity lines, then white outlines over them
+		static const uint8_t shades[BodyRenderer::shadeCount] = {0x90, 0xB8, 0xDC, 0xFF};
+		static const uint8_t red[3] = {0xFF, 0x00, 0x00};
+		static const uint8_t white[3] = {0xFF, 0xFF, 0xFF};
+		parallelFor(height, [&](int chunk, int top, int bottom)
+		{
+			for (int row=top;row<bottom;row++)
+			{
+				uint8_t* out = &this->pixels[(size_t)row*width*4];
+				for (int column=0;column<width;column++)
+				{
+					uint32_t bodies = counts[(size_t)row*width + column].load(memory_order_relaxed);
+					uint8_t shade = bodies > 0 ? shades[BodyRenderer::getShade(bodies)] : 0;
+					out[column*4] = shade;
+					out[column*4 + 1] = shade;
+					out[column*4 + 2] = shade;
+					out[column*4 + 3] = 0xFF;
+				}
+			}
+
+			for (int c=0;c<chunkCount;c++)
+				for (int k=0;k<this->circles[c].size();k++)
+				{
+					const Circle& circle = this->circles[c][k];
+					if ((circle.velX != 0 || circle.velY != 0) && min(circle.y, circle.y + circle.velY) < bottom && max(circle.y, circle.y + circle.velY) >= top)
+						this->drawLine(circle.x, circle.y, circle.x + circle.velX, circle.y + circle.velY, top, bottom, red);
+				}
+
+			for (int c=0;c<chunkCount;c++)
+				for (int k=0;k<this->circles[c].size();k++)
+				{
+					const Circle& circle = this->circles[c][k];
+					if (circle.y - circle.radius >= bottom || circle.y + circle.radius < top)
+						continue;
+					double deltaPhi = 2*3.1415926/circle.segments;
+					double lastX = circle.x + circle.radius;
+					double lastY = circle.y;
+					for (int s=1;s<=circle.segments;s++)
+					{
+						double nextX = circle.x + circle.radius*cos(deltaPhi*s);
+						double nextY = circle.y + circle.radius*sin(deltaPhi*s);
+						this->drawLine(lastX, lastY, nextX, nextY, top, bottom, white);
+						lastX = nextX;
+						lastY = nextY;
+					}
+				}
+		});
+	}
+
+	void drawDensity(const vector<nbody>& nbodyList, const ViewTransform& view)
+	{
+		int width = this->width;
+		float scale = 0;
+		const float* total = this->density.accumulate(nbodyList, view, &scale);
+		parallelFor(this->height, [&](int chunk, int start, int stop)
+		{
+			for (int row=start;row<stop;row++)
+			{
+				uint8_t* out = &this->pixels[(size_t)row*width*4];
+				for (int column=0;column<width;column++)
+				{
+					uint8_t value = DensityRenderer::getLevel(total[(size_t)row*width + column], scale);
+					out[column*4] = value;
+					out[column*4 + 1] = value;
+					out[column*4 + 2] = value;
+					out[column*4 + 3] = 0xFF;
+				}
+			}
+		});
+	}
+};
+
+//Renders frames and writes them out on its own thread, so encoding and writing one frame overlaps simulating the next
+//A path ending in .y4m gets one uncompressed 4:2:0 YUV4MPEG2 stream that ffmpeg and most players read. Any other path
+//gets a binary PPM image per frame, numbered as getFramePattern describes
+class FrameExporter
+{
+public:
+	FrameRasterizer rasterizer;
+	int framesQueued = 0;
+	//Frames that can wait to be drawn before submit blocks, each holds a copy of the bodies
+	int maxPending = 2;
+
+	FrameExporter()
+	{
+		this->worker = thread(&FrameExporter::run, this);
+	}
+
+	//Writes whatever is still queued before returning
+	~FrameExporter()
+	{
+		this->close();
+		{
+			lock_guard<mutex> guard(this->lock);
+			this->stopping = true;
+		}
+		this->wake.notify_all();
+		this->worker.join();
+	}
+
+	bool open(const string& path, int width, int height, double fps, int style)
+	{
+		this->close();
+		this->isStream = path.size() >= 4 && path.compare(path.size() - 4, 4, ".y4m") == 0;
+		if (!this->isStream && !getFramePattern(path, &this->pattern))
+		{
+			std::cout << "Can't number frames by " << path << ", it has more than one %d\n";
+			return false;
+		}
+		if (this->isStream)
+		{
+			this->stream = fopen(path.c_str(), "wb");
+			if (this->stream == NULL)
+			{
+				std::cout << "Couldn't open " << path << " to export frames to\n";
+				return false;
+			}
+			//Frame rates are written as a fraction in thousandths so 29.97 comes out right
+			fprintf(this->stream, "YUV4MPEG2 W%d H%d F%d:1000 Ip A1:1 C420jpeg\n", width, height, (int)(fps*1000 + .5));
+		}
+		this->width = width;
+		this->height = height;
+		this->rasterizer.style = style;
+		this->framesQueued = 0;
+		this->failed = false;
+		this->exporting = true;
+		return true;
+	}
+
+	bool isOpen()
+	{
+		return this->exporting;
+	}
+
+	//Queues the live bodies of list to be drawn through view as the next frame, blocking while maxPending frames are waiting
+	//Frames are never dropped, so a movie keeps every step it was given even when encoding falls behind
+	void submit(const vector<nbody>& list, const ViewTransform& view)
+	{
+		if (!this->exporting)
+			return;
+		{
+			unique_lock<mutex> guard(this->lock);
+			this->idle.wait(guard, [this]() { return this->pending.size() < this->maxPending; });
+			Request request;
+			if (this->spare.size() > 0)
+			{
+				request = move(this->spare.back());
+				this->spare.pop_back();
+			}
+			request.bodies.resize(list.size());
+			if (list.size() > 0)
+				memcpy(request.bodies.data(), list.data(), sizeof(nbody)*list.size());
+			request.view = view;
+			request.view.width = this->width;
+			request.view.height = this->height;
+			request.frame = this->framesQueued++;
+			this->pending.push_back(move(request));
+		}
+		this->wake.notify_all();
+	}
+
+	//Blocks until every submitted frame is written, then closes the stream
+	void close()
+	{
+		unique_lock<mutex> guard(this->lock);
+		this->idle.wait(guard, [this]() { return this->pending.size() == 0 && !this->writing; });
+		if (this->stream != NULL)
+			fclose(this->stream);
+		this->stream = NULL;
+		if (this->exporting)
+			std::cout << "Exported " << this->framesQueued << " frames" << (this->failed ? ", some couldn't be written" : "") << "\n";
+		this->exporting = false;
+	}
+
+private:
+	struct Request
+	{
+		vector<nbody> bodies;
+		ViewTransform view;
+		int frame;
+	};
+
+	mutex lock;
+	condition_variable wake;
+	condition_variable idle;
+	deque<Request> pending;
+	vector<Request> spare;
+	bool writing = false;
+	bool stopping = false;
+	bool exporting = false;
+	bool failed = false;
+	thread worker;
+	string pattern;
+	bool isStream = false;
+	FILE* stream = NULL;
+	int width = 0;
+	int height = 0;
+	vector<uint8_t> encoded;
+
+	//YUV4MPEG2 frame planes from the RGBA pixels: full resolution luma, then blue and red chroma averaged over 2x2 blocks
+	//BT.601 studio range, which is what players assume of a stream that doesn't say
+	void encodeY4m()
+	{
+		int width = this->width;
+		int height = this->height;
+		int chromaWidth = (width + 1)/2;
+		int chromaHeight = (height + 1)/2;
+		size_t lumaBytes = (size_t)width*height;
+		size_t chromaBytes = (size_t)chromaWidth*chromaHeight;
+		this->encoded.resize(lumaBytes + 2*chromaBytes);
+		const uint8_t* rgba = this->rasterizer.pixels.data();
+		uint8_t* luma = this->encoded.data();
+		uint8_t* blue = luma + lumaBytes;
+		uint8_t* red = blue + chromaBytes;
+
+		parallelFor(chromaHeight, [&](int chunk, int start, int stop)
+		{
+			for (int cy=start;cy<stop;cy++)
+			{
+				for (int cx=0;cx<chromaWidth;cx++)
+				{
+					double sumR = 0, sumG = 0, sumB = 0;
+					int samples = 0;
+					for (int y=cy*2;y<min(cy*2 + 2, height);y++)
+						for (int x=cx*2;x<min(cx*2 + 2, width);x++)
+						{
+							const uint8_t* pixel = rgba + ((size_t)y*width + x)*4;
+							double r = pixel[0], g = pixel[1], b = pixel[2];
+							luma[(size_t)y*width + x] = (uint8_t)(16.5 + (65.481*r + 128.553*g + 24.966*b)/255);
+							sumR += r;
+							sumG += g;
+							sumB += b;
+							samples++;
+						}
+					double r = sumR/samples, g = sumG/samples, b = sumB/samples;
+					blue[(size_t)cy*chromaWidth + cx] = (uint8_t)(128.5 + (-37.797*r - 74.203*g + 112.0*b)/255);
+					red[(size_t)cy*chromaWidth + cx] = (uint8_t)(128.5 + (112.0*r - 93.786*g - 18.214*b)/255);
+				}
+			}
+		});
+	}
+
+	void encodePpm()
+	{
+		char header[64];
+		int headerBytes = snprintf(header, sizeof(header), "P6\n%d %d\n255\n", this->width, this->height);
+		size_t pixelCount = (size_t)this->width*this->height;
+		this->encoded.resize(headerBytes + pixelCount*3);
+		memcpy(this->encoded.data(), header, headerBytes);
+		const uint8_t* rgba = this->rasterizer.pixels.data();
+		uint8_t* rgb = this->encoded.data() + headerBytes;
+		parallelFor(this->height, [&](int chunk, int start, int stop)
+		{
+			for (size_t p=(size_t)start*this->width;p<(size_t)stop*this->width;p++)
+			{
+				rgb[p*3] = rgba[p*4];
+				rgb[p*3 + 1] = rgba[p*4 + 1];
+				rgb[p*3 + 2] = rgba[p*4 + 2];
+			}
+		});
+	}
+
+	bool writeFrame(int frame)
+	{
+		if (this->isStream)
+		{
+			this->encodeY4m();
+			return fwrite("FRAME\n", 1, 6, this->stream) == 6 && fwrite(this->encoded.data(), 1, this->encoded.size(), this->stream) == this->encoded.size();
+		}
+
+		this->encodePpm();
+		char path[1024];
+		snprintf(path, sizeof(path), this->pattern.c_str(), frame);
+		FILE* file = fopen(path, "wb");
+		if (file == NULL)
+			return false;
+		bool written = fwrite(this->encoded.data(), 1, this->encoded.size(), file) == this->encoded.size();
+		return fclose(file) == 0 && written;
+	}
+
+	void run()
+	{
+		while (true)
+		{
+			Request request;
+			{
+				unique_lock<mutex> guard(this->lock);
+				this->wake.wait(guard, [this]() { return this->pending.size() > 0 || this->stopping; });
+				if (this->pending.size() == 0)
+					return;
+				request = move(this->pending.front());
+				this->pending.pop_front();
+				this->writing = true;
+			}
+			//A slot is free as soon as the bodies are taken, not once the frame is written
+			this->idle.notify_all();
+
+			this->rasterizer.draw(request.bodies, request.view);
+			bool written = this->writeFrame(request.frame);
+
+			{
+				lock_guard<mutex> guard(this->lock);
+				if (!written && !this->failed)
+					std::cout << "Couldn't write frame " << request.frame << "\n";
+				this->failed = this->failed || !written;
+				this->spare.push_back(move(request));
+				this->writing = false;
+			}
+			this->idle.notify_all();
+		}
+	}
+};
+
+#endif
@@ -0,0 +1,103 @@
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <chrono>
+#include <thread>
+#include <string>
+#include <algorithm>
+#ifdef _WIN32
+#include "windows.h"
+#include <mmsystem.h>
+#pragma comment(lib, "winmm.lib")
+#elif defined(__linux__)
+#include <time.h>
+#include <errno.h>
+#endif
+
+using namespace std;
+
+//Blocks until the deadline with as little oversleep as the platform allows
+//Linux sleeps on the monotonic clock to the absolute deadline, which wakes within tens of microseconds
+//Windows is asked for a 1ms timer once, after which Sleep(1) wakes within about a millisecond, so it sleeps until the last
+//2ms and only spins through those, leaving the rest of the frame's CPU time to the solvers
+void waitUntil(chrono::steady_clock::time_point deadline)
+{
+	using namespace std::chrono;
+#if defined(__linux__)
+	//steady_clock is CLOCK_MONOTONIC with libstdc++, so the deadline converts directly
+	nanoseconds sinceEpoch = duration_cast<nanoseconds>(deadline.time_since_epoch());
+	timespec target;
+	target.tv_sec = sinceEpoch.count()/1000000000;
+	target.tv_nsec = sinceEpoch.count()%1000000000;
+	while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &target, NULL) == EINTR);
+#elif defined(_WIN32)
+	static bool timerPeriodSet = false;
+	if (!timerPeriodSet)
+	{
+		timeBeginPeriod(1);
+		timerPeriodSet = true;
+	}
+	while (steady_clock::now() < deadline)
+	{
+		if (deadline - steady_clock::now() > milliseconds(2))
+			Sleep(1);
+		else
+			this_thread::yield();
+	}
+#else
+	this_thread::sleep_until(deadline);
+#endif
+}
+
+enum FrameMode
+{
+	//SDL_RenderPresent waits for the display, no extra waiting is done
+	FRAME_VSYNC,
+	//Frames start at a fixed rate, the time left over is slept through
+	FRAME_TARGET,
+	//Frames start as soon as the last one is presented
+	FRAME_UNCAPPED
+};
+
+//Decides when the next frame starts, call endFrame once after presenting each frame
+class FrameScheduler
+{
+public:
+	FrameMode mode = FRAME_TARGET;
+	double targetFps = 60;
+	chrono::steady_clock::time_point nextFrame = chrono::steady_clock::now();
+
+	double getFrameTime()
+	{
+		return 1/max(this->targetFps, 1.0);
+	}
+
+	void endFrame()
+	{
+		using namespace std::chrono;
+		if (this->mode != FRAME_TARGET)
+		{
+			this->nextFrame = steady_clock::now();
+			return;
+		}
+
+		//Deadlines are kept on a fixed grid so small wake up delays don't add up, a frame that runs long starts a new grid instead of rushing to catch up
+		steady_clock::time_point now = steady_clock::now();
+		this->nextFrame += duration_cast<steady_clock::duration>(duration<double>(this->getFrameTime()));
+		if (this->nextFrame < now)
+			this->nextFrame = now;
+		else
+			waitUntil(this->nextFrame);
+	}
+
+	string getDescription()
+	{
+		if (this->mode == FRAME_VSYNC)
+			return "vsync";
+		else if (this->mode == FRAME_TARGET)
+			return to_string((int)this->targetFps) + " fps";
+		return "uncapped";
+	}
+};
+
+#endif
@@ -3,21 +3,26 @@
 #include <memory>
 #include <math.h>
 #include <stdint.h>
+#include <string.h>
 #include "SDL/include/SDL.h"
 #include "SDL/include/SDL_ttf.h"
-#include <CL/cl.hpp>
-#include "windows.h"
 #include <chrono>
 #include <fstream>
+#include <future>
+#include <functional>
+#include <random>
+#include "nbody.h"
+#include "solvers.h"
+#include "render.h"
+#include "text.h"
+#include "frame.h"
+#include "trajectory.h"
+#include "snapshot.h"
+#include "rewind.h"
+#include "export.h"
 
 using namespace std;
 
-//Gravitational constant, a mass of 1 is equivalent to 1kg
-//double G = 6.67408E-11f;
-//double unitMass = 1.5*pow(10, 10);
-//Toy constant, a mass of 1 is equivalent to asteroid size  ~15 billion kg
-double G = 1;
-double unitMass = 1;
 double scale = 1.0;
 
 class MenuItem
@@ -29,15 +34,25 @@ public:
 	int height;
 	int borderSize = 0;
 	bool hasDragBar = false; //Bar at the top of menu for moving it
+	int dragBarHeight = 15;
 	bool transparent = false;
 	string text = "";
 	vector<MenuItem*> children;
 	SDL_Renderer* ren;
-	TTF_Font* font;
-	SDL_Surface* surface;
-	SDL_Texture* texture;
+	int fontSize = 11;
 	SDL_Color color = { 255, 255, 255 };
 	SDL_Color background = {0, 0, 0};
+	function<void()> onClick;
+	//Clickable items under the mouse get a lighter background
+	bool hovered = false;
+	//Set whenever something that changes how this item looks changes, cleared once the menu has been redrawn
+	//Code changing x, y, width or height directly has to call markDirty
+	bool dirty = true;
+	//The whole tree is drawn into this once and copied to the screen every frame, see renderCached
+	SDL_Texture* cache = nullptr;
+	int cacheWidth = 0;
+	int cacheHeight = 0;
+	MenuItem* hoveredItem = nullptr;
 	MenuItem(SDL_Renderer* argRen, int offsetX, int offsetY, int argWidth, int argHeight, int argBorderSize=0)
 	{
 		this->ren = argRen;
@@ -45,38 +60,161 @@ public:
 		this->y = offsetY;
 		this->width = argWidth;
 		this->height = argHeight;
-		this->font = TTF_OpenFont("C:/Windows/Fonts/arial.ttf", 11);
-		this->surface = TTF_RenderText_Solid(this->font, this->text.c_str(), this->color);
-		this->texture = SDL_CreateTextureFromSurface(argRen, this->surface);
 		this->borderSize = argBorderSize;
 	}
 
-	~MenuItem()
-	{
-		TTF_CloseFont(this->font);
-	}
-
 	void setDragBar(bool argDragBar)
 	{
 		this->hasDragBar = argDragBar;
+		this->dirty = true;
 	}
 
+	//Text is drawn from the shared glyph atlas, so this can be called every frame
 	void setText(string argText)
 	{
-		SDL_FreeSurface(this->surface);
-		SDL_DestroyTexture(this->texture);
+		if (argText != this->text)
+			this->dirty = true;
 		this->text = argText;
-		this->surface = TTF_RenderText_Solid(this->font, this->text.c_str(), this->color);
-		this->texture = SDL_CreateTextureFromSurface(this->ren, this->surface);
 	}
 
-	void captureInput();
+	void markDirty()
+	{
+		this->dirty = true;
+	}
+
+	bool isDirty()
+	{
+		if (this->dirty)
+			return true;
+		for (int i=0;i<this->children.size();i++)
+			if (this->children[i]->isDirty())
+				return true;
+		return false;
+	}
+
+	void clearDirty()
+	{
+		this->dirty = false;
+		for (int i=0;i<this->children.size();i++)
+			this->children[i]->clearDirty();
+	}
+
+	//Size of the area this item and its children cover, children can reach past the item's own height
+	void getExtent(int* extentWidth, int* extentHeight)
+	{
+		*extentWidth = this->width;
+		*extentHeight = this->height;
+		int totalY = this->hasDragBar ? this->dragBarHeight : 0;
+		for (int i=0;i<this->children.size();i++)
+		{
+			int childWidth, childHeight;
+			this->children[i]->getExtent(&childWidth, &childHeight);
+			*extentWidth = max(*extentWidth, this->children[i]->x + childWidth);
+			*extentHeight = max(*extentHeight, totalY + childHeight);
+			totalY += this->children[i]->height;
+		}
+	}
+
+	//Finds the item under the mouse for an item drawn at globalX, globalY, laying children out the same way render does
+	MenuItem* getItemAt(int globalX, int globalY, int mouseX, int mouseY)
+	{
+		int totalY = this->hasDragBar ? this->dragBarHeight : 0;
+		for (int i=0;i<this->children.size();i++)
+		{
+			MenuItem* item = this->children[i]->getItemAt(globalX + this->children[i]->x, globalY + totalY, mouseX, mouseY);
+			if (item != nullptr)
+				return item;
+			totalY += this->children[i]->height;
+		}
+
+		if (mouseX >= globalX && mouseX < globalX + this->width && mouseY >= globalY && mouseY < globalY + this->height)
+			return this;
+
+		return nullptr;
+	}
+
+	//Returns true if the event was a click on this menu, which then shouldn't reach the simulation
+	bool captureInput(SDL_Event event)
+	{
+		if (event.type != SDL_MOUSEBUTTONDOWN)
+			return false;
+
+		MenuItem* item = this->getItemAt(this->x, this->y, event.button.x, event.button.y);
+		if (item == nullptr)
+			return false;
+
+		if (item->onClick)
+			item->onClick();
+		return true;
+	}
+
+	//Draws the menu through its cache, only redrawing the tree into it when an item changed or the mouse moved onto another item
+	//The root item is drawn at x, y
+	void renderCached(int mouseX, int mouseY)
+	{
+		MenuItem* item = this->getItemAt(this->x, this->y, mouseX, mouseY);
+		if (item != nullptr && !item->onClick)
+			item = nullptr;
+		if (item != this->hoveredItem)
+		{
+			if (this->hoveredItem != nullptr)
+			{
+				this->hoveredItem->hovered = false;
+				this->hoveredItem->dirty = true;
+			}
+			if (item != nullptr)
+			{
+				item->hovered = true;
+				item->dirty = true;
+			}
+			this->hoveredItem = item;
+		}
+
+		if (!SDL_RenderTargetSupported(this->ren))
+		{
+			this->render(this->x, this->y, mouseX, mouseY);
+			return;
+		}
+
+		int extentWidth, extentHeight;
+		this->getExtent(&extentWidth, &extentHeight);
+		if (this->cache == nullptr || extentWidth != this->cacheWidth || extentHeight != this->cacheHeight)
+		{
+			if (this->cache != nullptr)
+				SDL_DestroyTexture(this->cache);
+			this->cache = SDL_CreateTexture(this->ren, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_TARGET, extentWidth, extentHeight);
+			SDL_SetTextureBlendMode(this->cache, SDL_BLENDMODE_BLEND);
+			this->cacheWidth = extentWidth;
+			this->cacheHeight = extentHeight;
+			this->dirty = true;
+		}
+
+		if (this->isDirty())
+		{
+			SDL_SetRenderTarget(this->ren, this->cache);
+			SDL_SetRenderDrawColor(this->ren, 0, 0, 0, 0);
+			SDL_RenderClear(this->ren);
+			this->render(0, 0, mouseX - this->x, mouseY - this->y);
+			SDL_SetRenderTarget(this->ren, NULL);
+			this->clearDirty();
+		}
+
+		SDL_Rect dest;
+		dest.x = this->x;
+		dest.y = this->y;
+		dest.w = this->cacheWidth;
+		dest.h = this->cacheHeight;
+		SDL_RenderCopy(this->ren, this->cache, NULL, &dest);
+	}
 
 	void render(int globalX, int globalY, int mouseX, int mouseY)
 	{
 		if (!this->transparent)
 		{
-			SDL_SetRenderDrawColor(this->ren, 0, 0, 0, 255);
+			if (this->hovered)
+				SDL_SetRenderDrawColor(this->ren, 60, 60, 60, 255);
+			else
+				SDL_SetRenderDrawColor(this->ren, 0, 0, 0, 255);
 			SDL_Rect back;
 			back.x = globalX;
 			back.y = globalY;
@@ -87,15 +225,9 @@ public:
 
 		if (this->text != "")
 		{
-			int textureWidth, textureHeight;
-			SDL_QueryTexture(this->texture, nullptr, nullptr, &textureWidth, &textureHeight);
-
-			SDL_Rect Message_rect; //create a rect
-			Message_rect.x = globalX + this->width/2 - textureWidth/2;  //controls the rect's x coordinate 
-			Message_rect.y = globalY + this->height/2 - textureHeight/2; // controls the rect's y coordinte
-			Message_rect.w = textureWidth; // controls the width of the rect
-			Message_rect.h = textureHeight; // controls the height of the rect
-			SDL_RenderCopy(ren, this->texture, NULL, &Message_rect);
+			GlyphAtlas* atlas = getGlyphAtlas(this->ren, this->fontSize);
+			int textWidth = atlas->measure(this->text);
+			atlas->draw(this->ren, this->text, globalX + this->width/2 - textWidth/2, globalY + this->height/2 - atlas->lineHeight/2, this->color);
 		}
 
 		if (this->borderSize)
@@ -119,7 +251,7 @@ public:
 			bar.x = globalX;
 			bar.y = globalY;
 			bar.w = this->width;
-			bar.h = 15;
+			bar.h = this->dragBarHeight;
 			SDL_SetRenderDrawColor(this->ren, 255, 255, 255, 255);
 			SDL_RenderDrawRect(this->ren, &bar);
 			totalY = bar.h;
@@ -152,178 +284,87 @@ class SystemMenu
 	}
 };
 
-vector<SDL_Point> getCirclePoints(int xOff, int yOff, int numPoints, double radius)
-{
-	vector<SDL_Point> circleCoords;
-	double deltaPhi = 2*3.1415926/numPoints;
-	for (int i=0; i<numPoints+1; i++)
-	{
-		double tempX = radius * cos(deltaPhi * i);
-		double tempY = radius * sin(deltaPhi * i);
-		SDL_Point tempCoord;
-		tempCoord.x = tempX + xOff;
-		tempCoord.y = tempY + yOff;
-		
-		circleCoords.push_back(tempCoord);
-	}
-	
-	return circleCoords;
-}
-
-struct __attribute__ ((packed)) nbody
-{
-	cl_double x;
-	cl_double y;
-	cl_double velX;
-	cl_double velY;
-	cl_double radius;
-	cl_int mass;
-	bool staticBody;
-	bool dead;
-};
-
-nbody getNewNBody(int newX, int newY, double dX, double dY, int unitMasses, bool staticFlag)
-{
-	nbody newNBody;
-	newNBody.x = newX;
-	newNBody.y = newY;
-	newNBody.velX = dX;
-	newNBody.velY = dY;
-	//By basing the mass and radius on a standard unit we can scale to large and small by changing the unit mass
-	newNBody.mass = unitMass*unitMasses;
-	newNBody.radius = 1.0;
-	if (unitMasses > 1)
-		newNBody.radius *= cbrt(unitMasses);
-
-	newNBody.staticBody = staticFlag;
-
-	return newNBody;
-}
-
-void placeRandomField(int massCount, double velocity, double radius, SDL_Window* renderWindow, vector<nbody>* nbodyList)
-{
-	int width;
-	int height;
-	SDL_GetWindowSize(renderWindow, &width, &height);
-	for (int i=0; i<massCount; i++)
-	{
-		double dist = (double)rand()/RAND_MAX*radius;
-		double placeAngle = (double)rand()/RAND_MAX*2*3.1415926;
-		double x = cos(placeAngle) * dist + (double)width/2;
-		double y = sin(placeAngle) * dist + (double)height/2;
-		double angle = (double)rand()/RAND_MAX*2*3.1415926;
-		double newVelX = cos(angle)*velocity;
-		double newVelY = sin(angle)*velocity;
-		nbody newBody = getNewNBody((int) x, (int) y, newVelX, newVelY, 1, false);
-		nbodyList->push_back(newBody);
-	}
-}
-
-void makeAccDisk(int massCount, double radius, double centerMass, SDL_Window* renderWindow, vector<nbody>* nbodyList)
-{
-	nbodyList->clear();
-	int width;
-	int height;
-	SDL_GetWindowSize(renderWindow, &width, &height);
-	nbody newBody = getNewNBody((double)width/2, (double)height/2, 0, 0, centerMass, true);
-	nbodyList->push_back(newBody);
-		
-	for (int i=0;i<massCount;i++)
-	{
-		double newDist = (double)rand()/RAND_MAX*radius+50;
-		double newAngle = (double)rand()/RAND_MAX*2*3.1415926;
-		double dX = cos(newAngle)*newDist;
-		double dY = sin(newAngle)*newDist;
-		double totalVel = sqrt((centerMass*G)/newDist);
-		double tanAngle = atan2(-dY, dX);
-		double newVelX = sin(tanAngle)*totalVel;
-		double newVelY = cos(tanAngle)*totalVel;
-		nbody newBody = getNewNBody(dX + (double)width/2, dY + (double)height/2, newVelX, newVelY, 1, false);
-		nbodyList->push_back(newBody);
-	}
-}
-
 void printTotalMomentum(vector<nbody>* nbodyList);
 
-vector<nbody> updateBodies(vector<nbody> nbodyList, cl::Program program, cl::Device default_device, cl::Context context, cl::CommandQueue queue, cl::Buffer buffer_A, cl::Buffer buffer_C, cl::Buffer buffer_N)
+//Reads a saved file such as nbody.csv back, the "#seeds" line holds the generator seeds of the fields in it
+//Files with an index and more bodies than regionThreshold only have the bodies inside region loaded, unless region is NULL
+//partial is set when that happened, so the part isn't saved over the whole file
+bool loadNBodyList(const string& path, vector<nbody>* nbodyList, vector<uint64_t>* seeds, const ViewTransform* region, int regionThreshold, bool* partial)
 {
-
-	// apparently OpenCL only likes arrays ...
-	// N holds the number of elements in the vectors we want to add
-	int N[1] = {nbodyList.size()};
-	int n = N[0];
-
-	// push write commands to queue
-	queue.enqueueWriteBuffer(buffer_A, CL_TRUE, 0, sizeof(nbody)*n, &nbodyList[0]);
-	queue.enqueueWriteBuffer(buffer_N, CL_TRUE, 0, sizeof(int),   N);
-
-	nbody C[n] = {0};
-	queue.enqueueWriteBuffer(buffer_C, CL_TRUE, 0, sizeof(nbody)*n, C);
-
-	// RUN ZE KERNEL
-	cl::Kernel simple_add(program, "simple_add");
-	simple_add.setArg(0, buffer_A);
-	simple_add.setArg(1, buffer_C);
-	simple_add.setArg(2, buffer_N);
-	queue.enqueueNDRangeKernel(simple_add, cl::NullRange, cl::NDRange(max(1, n)), cl::NullRange);
-	queue.finish();
-
-	// read result from GPU to here
-	queue.enqueueReadBuffer(buffer_C, CL_TRUE, 0, sizeof(nbody)*n, C);
-
-	for (int i=0;i<nbodyList.size();i++)
-	{
-		nbodyList[i].x = C[i].x;
-		nbodyList[i].y = C[i].y;
-		nbodyList[i].velX = C[i].velX;
-		nbodyList[i].velY = C[i].velY;
-		nbodyList[i].mass = C[i].mass;
-		nbodyList[i].radius = C[i].radius;
-		nbodyList[i].dead = C[i].dead;
-	}
-
-	return nbodyList;
+	vector<CsvError> errors;
+	double minX, minY, maxX, maxY;
+	int total = region != NULL && region->getVisibleBounds(&minX, &minY, &maxX, &maxY) ? getSnapshotBodyCount(path) : -1;
+	bool inView = total > regionThreshold && importNBodyRegion(path, minX, minY, maxX, maxY, nbodyList, seeds, &errors);
+	if (!inView && !importNBodyCsv(path, nbodyList, seeds, &errors))
+		return false;
+	*partial = inView;
+
+	for (int i=0;i<errors.size() && i<10;i++)
+		std::cout << path << " line " << errors[i].line << ": " << errors[i].message << "\n";
+	if (errors.size() > 10)
+		std::cout << errors.size() - 10 << " more lines couldn't be read\n";
+	if (inView)
+		std::cout << "Loaded the " << nbodyList->size() << " of " << total << " bodies in view, Shift+G loads them all\n";
+	else
+		std::cout << "Loaded " << nbodyList->size() << " bodies\n";
+	return true;
 }
 
-void saveNBodyList(vector<nbody>* nbodyList)
+//path with _step and the step added before its extension, where a recording carries on after a rewind
+string getSegmentPath(const string& path, uint64_t step)
 {
-	ofstream f;
-	f.open("nbody.csv", ios::out);
-
-	for (int i=0;i<nbodyList->size();i++)
-	{
-		nbody curBody = nbodyList->at(i);
-		if (!curBody.dead)
-			f << curBody.x << "," << curBody.y << "," << curBody.velX << "," << curBody.velY << "," << curBody.radius << "," << curBody.mass << "\n";
-
-	}
-
-	f.close();
+	size_t dot = path.find_last_of('.');
+	size_t slash = path.find_last_of("/\\");
+	if (dot == string::npos || (slash != string::npos && dot < slash))
+		dot = path.size();
+	return path.substr(0, dot) + "_step" + to_string(step) + path.substr(dot);
 }
 
-void loadNBodyList(vector<nbody>* nbodyList)
+//Runs the simulation without a window, exporting the bodies as they start and then every exportEvery steps until frames frames are written,
+//or until the program is stopped when frames is 0
+int runHeadless(const string& engineChoice, vector<nbody>* nbodyList, FrameExporter* exporter, const ViewTransform& view, int exportEvery, int frames)
 {
-	nbodyList->clear();
+	using namespace std::chrono;
 
-	ifstream f;
-	f.open("nbody.csv", ios::in);
+	ClEngine engine;
+	CpuSolver cpuSolver;
+	TreeSolver treeSolver;
+	vector<ForceSolver*> solvers = {&engine, &cpuSolver, &treeSolver};
+	engine.available = engine.init();
+	calibrateSolvers(solvers);
 
-	string line;
-	while (getline(f, line))
+	steady_clock::time_point started = steady_clock::now();
+	steady_clock::time_point lastReport = started;
+	for (int frame=0;frames == 0 || frame < frames;frame++)
 	{
-		nbody newBody;
-		newBody.x = atof(strtok((char*)line.c_str(), ","));
-		newBody.y = atof(strtok(nullptr, ","));
-		newBody.velX = atof(strtok(nullptr, ","));
-		newBody.velY = atof(strtok(nullptr, ","));
-		newBody.radius = atof(strtok(nullptr, ","));
-		newBody.mass = atoi(strtok(nullptr, ","));
-		newBody.dead = false;
-		newBody.staticBody = false;
-		nbodyList->push_back(newBody);
-	}
+		if (frame > 0)
+		{
+			ForceSolver* solver = selectSolver(solvers, engineChoice, true, nbodyList->size());
+			if (solver == NULL)
+			{
+				std::cout << "No solver for --engine=" << engineChoice << "\n";
+				return 1;
+			}
+			solver->stepMany(nbodyList, exportEvery);
+			int dead = count_if(nbodyList->begin(), nbodyList->end(), [](const nbody& curBody) { return curBody.dead; });
+			if (dead > nbodyList->size()/8)
+				nbodyList->erase(remove_if(nbodyList->begin(), nbodyList->end(), [](const nbody& curBody) { return curBody.dead; }), nbodyList->end());
+		}
+		//Only the copy happens here, the frame is drawn and written while the next steps run
+		exporter->submit(*nbodyList, view);
 
-	f.close();
+		steady_clock::time_point now = steady_clock::now();
+		if (duration<double>(now - lastReport).count() >= 5 || frame == frames - 1)
+		{
+			std::cout << "Frame " << frame + 1;
+			if (frames > 0)
+				std::cout << " of " << frames;
+			std::cout << ", " << (frame + 1)/max(duration<double>(now - started).count(), 1e-9) << " frames per second\n";
+			lastReport = now;
+		}
+	}
+	exporter->close();
+	return 0;
 }
 
 void printTotalMomentum(vector<nbody>* nbodyList)
@@ -345,145 +386,244 @@ int main(int argc, char** argv)
 {
 	using namespace std::chrono;
 
-	// get all platforms (drivers), e.g. NVIDIA
-	std::vector<cl::Platform> all_platforms;
-	cl::Platform::get(&all_platforms);
-
-	if (all_platforms.size()==0) {
-		std::cout<<" No platforms found. Check OpenCL installation!\n";
-		exit(1);
-	}
-	cl::Platform default_platform=all_platforms[0];
-	std::cout << "Using platform: "<<default_platform.getInfo<CL_PLATFORM_NAME>()<<"\n";
-
-	// get default device (CPUs, GPUs) of the default platform
-	std::vector<cl::Device> all_devices;
-	default_platform.getDevices(CL_DEVICE_TYPE_ALL, &all_devices);
-	if(all_devices.size()==0){
-		std::cout<<" No devices found. Check OpenCL installation!\n";
-		exit(1);
+	//Which solver steps the simulation: opencl, cpu, tree, or auto to pick the fastest for the current body count
+	string engineChoice = "auto";
+	//vsync, uncapped, or a frame rate to pace frames to
+	string fpsChoice = "vsync";
+	//Trajectory recording, toggled with T. A step is recorded at most every trajectoryEvery steps,
+	//and only at the end of a batch, so with time warp on the spacing is at least the batch length
+	string trajectoryPath = "trajectory.nbt";
+	int trajectoryEvery = 10;
+	bool recordTrajectory = false;
+	//none, xor (lossless) or quantized to within trajectoryError of every position and velocity
+	int trajectoryCompression = COMPRESSION_NONE;
+	double trajectoryError = 1e-3;
+	//Seconds between checkpoints of the bodies to checkpoint.csv, 0 turns them off
+	double checkpointEvery = 0;
+	//Loading a saved file with more bodies than this only loads the ones in view
+	int regionThreshold = 1000000;
+	//Steps between the snapshots kept for rewinding, and the MB they may take, 0 turns rewinding off
+	int rewindEvery = 10;
+	double rewindMemory = 256;
+	//Frame export, toggled with X. Frames are widthxheight and show exportRegion, or what the window shows when exporting starts
+	string exportPath = "export.y4m";
+	bool exportFromStart = false;
+	int exportWidth = 1920;
+	int exportHeight = 1080;
+	int exportStyle = EXPORT_OUTLINE;
+	int exportEvery = 10;
+	double exportFps = 30;
+	//Frames to export before stopping, 0 for no limit. Left at -1 there's no limit with the window and 300 headless
+	int exportFrames = -1;
+	bool hasExportRegion = false;
+	double exportRegion[4];
+	//Runs without a window, simulating bodies loaded from loadPath and exporting exportFrames frames
+	bool headless = false;
+	string loadPath;
+	//Seed of the next generated field, each field takes the next one so a run started with --seed is reproducible
+	uint64_t nextSeed = random_device()();
+	for (int i=1;i<argc;i++)
+	{
+		if (strncmp(argv[i], "--engine=", 9) == 0)
+			engineChoice = argv[i] + 9;
+		else if (strncmp(argv[i], "--seed=", 7) == 0)
+			nextSeed = strtoull(argv[i] + 7, NULL, 10);
+		else if (strncmp(argv[i], "--fps=", 6) == 0)
+			fpsChoice = argv[i] + 6;
+		else if (strncmp(argv[i], "--trajectory=", 13) == 0)
+		{
+			trajectoryPath = argv[i] + 13;
+			recordTrajectory = true;
+		}
+		else if (strncmp(argv[i], "--trajectory-every=", 19) == 0)
+			trajectoryEvery = max(1, atoi(argv[i] + 19));
+		else if (strncmp(argv[i], "--trajectory-compression=", 25) == 0)
+		{
+			trajectoryCompression = getCompressionMode(argv[i] + 25);
+			if (trajectoryCompression < 0)
+			{
+				std::cout << "No trajectory compression called " << (argv[i] + 25) << ", pick none, xor or quantized\n";
+				return 1;
+			}
+		}
+		else if (strncmp(argv[i], "--trajectory-error=", 19) == 0)
+			trajectoryError = atof(argv[i] + 19);
+		else if (strncmp(argv[i], "--checkpoint-every=", 19) == 0)
+			checkpointEvery = atof(argv[i] + 19);
+		else if (strncmp(argv[i], "--region-threshold=", 19) == 0)
+			regionThreshold = atoi(argv[i] + 19);
+		else if (strncmp(argv[i], "--rewind-every=", 15) == 0)
+			rewindEvery = max(1, atoi(argv[i] + 15));
+		else if (strncmp(argv[i], "--rewind-memory=", 16) == 0)
+			rewindMemory = atof(argv[i] + 16);
+		else if (strncmp(argv[i], "--export=", 9) == 0)
+		{
+			exportPath = argv[i] + 9;
+			exportFromStart = true;
+		}
+		else if (strncmp(argv[i], "--export-size=", 14) == 0)
+			sscanf(argv[i] + 14, "%dx%d", &exportWidth, &exportHeight);
+		else if (strncmp(argv[i], "--export-style=", 15) == 0)
+		{
+			exportStyle = getExportStyle(argv[i] + 15);
+			if (exportStyle < 0)
+			{
+				std::cout << "No export style called " << (argv[i] + 15) << ", pick outline or density\n";
+				return 1;
+			}
+		}
+		else if (strncmp(argv[i], "--export-every=", 15) == 0)
+			exportEvery = max(1, atoi(argv[i] + 15));
+		else if (strncmp(argv[i], "--export-fps=", 13) == 0)
+			exportFps = max(1.0, atof(argv[i] + 13));
+		else if (strncmp(argv[i], "--export-frames=", 16) == 0)
+			exportFrames = max(0, atoi(argv[i] + 16));
+		else if (strncmp(argv[i], "--export-region=", 16) == 0)
+			hasExportRegion = sscanf(argv[i] + 16, "%lf,%lf,%lf,%lf", &exportRegion[0], &exportRegion[1], &exportRegion[2], &exportRegion[3]) == 4;
+		else if (strcmp(argv[i], "--headless") == 0)
+			headless = true;
+		else if (strncmp(argv[i], "--load=", 7) == 0)
+			loadPath = argv[i] + 7;
 	}
+	exportWidth = max(exportWidth, 1);
+	exportHeight = max(exportHeight, 1);
 
-	// use device[1] because that's a GPU; device[0] is the CPU
-	cl::Device default_device=all_devices[0];
-	std::cout<< "Using device: "<<default_device.getInfo<CL_DEVICE_NAME>()<<"\n";
-
-	// a context is like a "runtime link" to the device and platform;
-	// i.e. communication is possible
-	cl::Context context({default_device});
-
-	// create the program that we want to execute on the device
-	cl::Program::Sources sources;
-
-	// calculates for each element; C = A + B
-	std::string kernel_code=
-		"typedef struct __attribute__ ((packed)) {"
-		"	double x;"
-		"	double y;"
-		"	double velX;"
-		"	double velY;"
-		"	double radius;"
-		"	int mass;"
-		"	bool staticBody;"
-		"   bool dead;"
-		"} nbody;"
-		""
-		"   void kernel simple_add(global const nbody* A, global nbody* C, global const int* N) {"
-		"       int ID, Nthreads, n, ratio, start, stop;"
-		"		double timeStep, G;"
-		""
-		"       ID = get_global_id(0);"
-		"       Nthreads = get_global_size(0);"
-		"		n = N[0];"
-		""
-		"       ratio = (n / Nthreads);"  // number of elements for each thread
-		"       start = ratio * ID;"
-		"       stop  = ratio * (ID + 1);"
-		"		timeStep = .1;"
-		"		G = 1;"
-		"       for (int i=start; i<stop; i++){"
-		"           nbody curBody = A[i];"
-		"			if (C[i].dead) continue;"
-		"			for (int t=0; t < n; t++)"
-		"			{"
-		"				if (i != t)"
-		"				{"
-		"					nbody target = A[t];"
-		"					double distX = target.x - curBody.x;"
-		"					double distY = target.y - curBody.y;"
-		"					double totalDist = sqrt(distX*distX + distY*distY);"
-		"					if (totalDist == 0) continue;"
-		""
-		"					bool withinRange = totalDist < target.radius || totalDist < curBody.radius;"
-		"					if ((withinRange && (curBody.mass >= target.mass || curBody.staticBody)) && !target.staticBody)"
-		"					{"
-		"						if (curBody.mass == target.mass && i < t)"
-		"							continue;"
-		"						curBody.velX = (curBody.mass*curBody.velX + target.mass*target.velX)/(curBody.mass+target.mass);"
-		"						curBody.velY = (curBody.mass*curBody.velY + target.mass*target.velY)/(curBody.mass+target.mass);"
-		"						curBody.mass += target.mass;"
-		"						curBody.radius = cbrt(target.radius*target.radius*target.radius + curBody.radius*curBody.radius*curBody.radius);"
-		"						C[t].dead = 1;"
-		"					}"
-		"					else"
-		"					{"
-		"						double accel = target.mass*G/(totalDist*totalDist);"
-		"						double accX = accel * distX/totalDist;"
-		"						double accY = accel * distY/totalDist;"
-		"						curBody.velX += accX*timeStep;"
-		"						curBody.velY += accY*timeStep;"
-		"					}"
-		"				}"	
-		"			}"
-		""
-		"			if (curBody.staticBody){"
-		"				curBody.velX = 0;"
-		"				curBody.velY = 0;"
-		"			}"
-		""			
-		"           C[i].velX = curBody.velX;"
-		"           C[i].velY = curBody.velY;"
-		" 			C[i].x = curBody.x + curBody.velX*timeStep;"
-		"			C[i].y = curBody.y + curBody.velY*timeStep;"
-		"			C[i].mass = curBody.mass;"
-		"			C[i].radius = curBody.radius;"
-		"		}"
-		"   }";
-	
-	sources.push_back({kernel_code.c_str(), kernel_code.length()});
-
-	cl::Program program(context, sources);
-	if (program.build({default_device}) != CL_SUCCESS) {
-		std::cout << "Error building: " << program.getBuildInfo<CL_PROGRAM_BUILD_LOG>(default_device) << std::endl;
-		exit(1);
+	vector<nbody> nbodyList;
+	//Seeds of the generated fields currently in the list, saved with it
+	vector<uint64_t> fieldSeeds;
+	//Set while nbodyList only holds the bodies in view of a bigger file, saves and checkpoints then go to files of their own
+	bool partialLoad = false;
+	if (loadPath.size() > 0 && !loadNBodyList(loadPath, &nbodyList, &fieldSeeds, NULL, 0, &partialLoad))
+		return 1;
+
+	FrameExporter exporter;
+	ViewTransform exportView;
+	if (headless)
+	{
+		if (nbodyList.size() == 0)
+		{
+			std::cout << "--headless needs bodies to simulate, from --load=path\n";
+			return 1;
+		}
+		//With no region given the frames are fitted to where the bodies start out
+		if (!hasExportRegion)
+			getBodyBounds(nbodyList, .05, &exportRegion[0], &exportRegion[1], &exportRegion[2], &exportRegion[3]);
+		exportView = getRegionView(exportWidth, exportHeight, exportRegion[0], exportRegion[1], exportRegion[2], exportRegion[3]);
+		if (!exporter.open(exportPath, exportWidth, exportHeight, exportFps, exportStyle))
+			return 1;
+		std::cout << "Exporting " << getExportStyleName(exportStyle) << " frames every " << exportEvery << " steps to " << exportPath << "\n";
+		return runHeadless(engineChoice, &nbodyList, &exporter, exportView, exportEvery, exportFrames >= 0 ? exportFrames : 300);
 	}
 
-	// create a queue (a queue of commands that the GPU will execute)
-	cl::CommandQueue queue(context, default_device);
-
-	// create buffers on device (allocate space on GPU)
-	cl::Buffer buffer_A(context, CL_MEM_READ_WRITE, sizeof(nbody) * 100000);
-	cl::Buffer buffer_C(context, CL_MEM_READ_WRITE, sizeof(nbody) * 100000);
-	cl::Buffer buffer_N(context, CL_MEM_READ_ONLY,  sizeof(int));
-
 	bool running = true;
 	SDL_Event event;
 	SDL_Init(SDL_INIT_EVERYTHING);
 	SDL_Window *mainWin = SDL_CreateWindow("NBODY SIM", 100, 100, 1000, 720, SDL_WINDOW_SHOWN);
-	SDL_Renderer *ren = SDL_CreateRenderer(mainWin, -1, SDL_RENDERER_ACCELERATED);
 
-	vector<nbody> nbodyList;
+	//SDL 2.0.8 can only turn vsync on when the renderer is made, so it is picked once here
+	//If the driver doesn't give us vsync frames are paced to the display's refresh rate instead
+	FrameScheduler frameScheduler;
+	if (fpsChoice == "uncapped")
+		frameScheduler.mode = FRAME_UNCAPPED;
+	else if (fpsChoice != "vsync")
+		frameScheduler.targetFps = max(1.0, atof(fpsChoice.c_str()));
+	SDL_DisplayMode displayMode;
+	if (fpsChoice == "vsync" && SDL_GetWindowDisplayMode(mainWin, &displayMode) == 0 && displayMode.refresh_rate > 0)
+		frameScheduler.targetFps = displayMode.refresh_rate;
+
+	SDL_Renderer *ren = SDL_CreateRenderer(mainWin, -1, SDL_RENDERER_ACCELERATED | (fpsChoice == "vsync" ? SDL_RENDERER_PRESENTVSYNC : 0));
+	SDL_RendererInfo rendererInfo;
+	if (fpsChoice == "vsync" && SDL_GetRendererInfo(ren, &rendererInfo) == 0 && (rendererInfo.flags & SDL_RENDERER_PRESENTVSYNC))
+		frameScheduler.mode = FRAME_VSYNC;
+	std::cout << "Frame pacing: " << frameScheduler.getDescription() << "\n";
+
+	//Device discovery, the kernel build and calibration can take seconds, so do them in the background while the window is already usable
+	//Bodies stay frozen until that is done, even for the CPU solvers since calibration steps them, and auto selection falls back to the CPU if OpenCL isn't available
+	ClEngine engine;
+	CpuSolver cpuSolver;
+	TreeSolver treeSolver;
+	vector<ForceSolver*> solvers = {&engine, &cpuSolver, &treeSolver};
+	future<void> backendInit = async(launch::async, [&]()
+	{
+		engine.available = engine.init();
+		calibrateSolvers(solvers);
+	});
+	bool backendReady = false;
+	ForceSolver* activeSolver = NULL;
+	//Overlap the next OpenCL step with drawing the current one, at the cost of showing results a step late
+	bool pipelined = false;
+	SDL_SetWindowTitle(mainWin, "NBODY SIM (initializing OpenCL...)");
+
+	//Steps run in the background on their own copy so drawing never waits for them, nbodyList only changes when one finishes
+	//A step is started from nbodyList as soon as the last one is picked up, so slow steps don't hold back the frame rate
+	//The batch writes into stepResults, so they are declared before the future and outlive it
+	vector<nbody> stepSources;
+	vector<nbody> stepResults;
+	future<double> stepTask;
+	bool stepRunning = false;
+	//Time warp: how many steps each background batch runs. Automatically it is as many as fit in a frame, so small
+	//simulations advance thousands of steps a second instead of one per frame, and large ones still get one per batch
+	int substeps = 1;
+	bool autoSubsteps = true;
+	//Batches are sized to a frame so each frame has a new step to show
+	double targetFrameTime = frameScheduler.getFrameTime();
+	int maxSubsteps = 4096;
+	int stepSubsteps = 1;
+	int displaySubsteps = 1;
+	//Sources and results of the last finished step, the view is drawn between them
+	vector<nbody> displaySources;
+	vector<nbody> displayResults;
+	vector<nbody> displayList;
+	//Size of nbodyList when the last batch was picked up, while it holds a different number it has been changed and is drawn as is
+	int publishedSize = -1;
+	steady_clock::time_point lastStepDone = steady_clock::now();
+	double stepInterval = 0;
+	//0 draws the latest step as is, 1 interpolates between the last two, 2 extrapolates from the latest along velocities
+	int interpolation = 1;
+	//Steps simulated since the program started, the step number trajectories are recorded at
+	uint64_t simulatedSteps = 0;
+	uint64_t lastRecordedStep = 0;
+	//Frames are written on the recorder's thread, recording one only copies the bodies
+	TrajectoryRecorder trajectory;
+	trajectory.setCompression(trajectoryCompression, trajectoryError);
+	if (recordTrajectory)
+		trajectory.open(trajectoryPath);
+	//Saves and checkpoints are written on the snapshot writer's thread, only copying the bodies costs a frame anything
+	SnapshotWriter snapshots;
+	steady_clock::time_point lastCheckpoint = steady_clock::now();
+	//'[' and ']' move through the ring while stepping is paused, Enter carries on from the snapshot shown
+	SnapshotRing rewindRing;
+	rewindRing.memoryBudget = rewindMemory*(1 << 20);
+	uint64_t lastRewindStep = 0;
+	//Snapshot being shown, -1 while running
+	int scrubIndex = -1;
+	uint64_t lastExportStep = 0;
 
 	TTF_Init();
 
 	MenuItem mainMenu(ren, 50, 50, 100, 30);
 	mainMenu.setDragBar(true);
+	string engineNames[] = {"auto", "opencl", "cpu", "tree"};
+	string engineLabels[] = {"Auto", "OpenCL", "CPU direct", "Tree"};
+	vector<MenuItem*> engineItems;
+	function<void()> updateEngineMenu = [&]()
+	{
+		for (int i=0;i<engineItems.size();i++)
+			engineItems[i]->setText((engineChoice == engineNames[i] ? "> " : "") + engineLabels[i]);
+	};
 	for (int i=0;i<4;i++)
 	{
 		MenuItem* item = new MenuItem(ren, 0, 0, 100, 30, 1);
-		item->setText("test " + to_string(i));
+		string name = engineNames[i];
+		item->onClick = [&, name]()
+		{
+			engineChoice = name;
+			updateEngineMenu();
+		};
+		engineItems.push_back(item);
 		mainMenu.children.push_back(item);
 	}
+	updateEngineMenu();
 
 	//Keep track if we have been holding a keyboard or mouse button is being held down
 	bool buttonFlag = false;
@@ -501,6 +641,37 @@ int main(int argc, char** argv)
 	int dY = 0;
 	double cameraOffsetX = 0;
 	double cameraOffsetY = 0;
+	BodyRenderer bodyRenderer;
+	//Draw a density map of the bodies instead of their outlines
+	bool densityMode = false;
+	DensityRenderer densityRenderer;
+	//Frames show the region they were started with, whatever the window does afterwards
+	function<void()> startExport = [&]()
+	{
+		if (!hasExportRegion)
+		{
+			int width, height;
+			SDL_GetWindowSize(mainWin, &width, &height);
+			ViewTransform windowView;
+			windowView.width = width;
+			windowView.height = height;
+			windowView.cameraOffsetX = cameraOffsetX;
+			windowView.cameraOffsetY = cameraOffsetY;
+			windowView.scale = scale;
+			windowView.rootScale = rootScale;
+			if (!windowView.getVisibleBounds(&exportRegion[0], &exportRegion[1], &exportRegion[2], &exportRegion[3]) && !getBodyBounds(nbodyList, .05, &exportRegion[0], &exportRegion[1], &exportRegion[2], &exportRegion[3]))
+			{
+				//Root scale with nothing to fit, the area the window would show without it
+				windowView.rootScale = false;
+				windowView.getVisibleBounds(&exportRegion[0], &exportRegion[1], &exportRegion[2], &exportRegion[3]);
+			}
+		}
+		exportView = getRegionView(exportWidth, exportHeight, exportRegion[0], exportRegion[1], exportRegion[2], exportRegion[3]);
+		if (exporter.open(exportPath, exportWidth, exportHeight, exportFps, exportStyle))
+			std::cout << "Exporting " << getExportStyleName(exportStyle) << " frames every " << exportEvery << " steps to " << exportPath << "\n";
+	};
+	if (exportFromStart)
+		startExport();
 	high_resolution_clock::time_point lastTime = high_resolution_clock::now();
 	vector<duration<double>> timeSamples;
 	while (running)
@@ -538,70 +709,123 @@ int main(int argc, char** argv)
 		int width;
 		int height;
 		SDL_GetWindowSize(mainWin, &width, &height);
-		double centerX = cameraOffsetX + (double)width/2;
-		double centerY = cameraOffsetY + (double)height/2;
 
 		//Apply gravitational acceleration between all bodies
 		//Combine bodies that have moved too close to one another (perfectly elastic collision)
-		nbodyList = updateBodies(nbodyList, program, default_device, context, queue, buffer_A, buffer_C, buffer_N);
+		if (!backendReady && backendInit.wait_for(seconds(0)) == future_status::ready)
+		{
+			backendReady = true;
+			if (!engine.isAvailable())
+				std::cout << "OpenCL unavailable, simulating on the CPU\n";
+		}
 
-		//printTotalMomentum(&nbodyList);
+		ForceSolver* solver = selectSolver(solvers, engineChoice, backendReady, nbodyList.size());
+		if (solver != activeSolver)
+		{
+			activeSolver = solver;
+			if (solver != NULL)
+			{
+				std::cout << "Stepping with " << solver->getDescription() << "\n";
+				SDL_SetWindowTitle(mainWin, ("NBODY SIM - " + solver->getDescription()).c_str());
+			}
+		}
 
-		for (int i=nbodyList.size()-1; i>=0; i--)
+		if (stepRunning && stepTask.wait_for(seconds(0)) == future_status::ready)
 		{
-			if (nbodyList[i].dead)
+			double batchSeconds = stepTask.get();
+			stepRunning = false;
+
+			//Grows by at most double per batch so one quick batch doesn't overshoot, drops straight away if batches run long
+			if (autoSubsteps)
 			{
-				nbodyList.erase(nbodyList.begin() + i);
-				continue;
+				double fitting = stepSubsteps*targetFrameTime/max(batchSeconds, 1e-6);
+				substeps = max(1, min(maxSubsteps, (int)min(2.0*substeps, fitting)));
 			}
-			nbody curBody = nbodyList.at(i);
-			vector<SDL_Point> circleCoords;
-			//Get the points representing the circle of the body and render it
-			//If we are in root scale then calculate the offset from the center and take the sqrt
-			//This lets us seem things that have flown far beyond the screen
-			if (rootScale)
+
+			//Bodies placed, cleared or loaded while the step ran win over its results
+			bool unchanged = nbodyList.size() == stepSources.size() && (nbodyList.size() == 0 || memcmp(nbodyList.data(), stepSources.data(), sizeof(nbody)*nbodyList.size()) == 0);
+			if (unchanged)
 			{
-				//Get the offset from the center of the screen
-				double xOff = curBody.x - centerX;
-				double yOff = curBody.y - centerY;
-				//Get the distance from the center of the screen
-				double dist = sqrt(xOff*xOff + yOff*yOff);
-				//Get the root distance and split it into its components
-				double rootDist = sqrt(dist);
-				double rootScaleX = 0, rootScaleY = 0;
-				if (rootDist > 0)
+				steady_clock::time_point now = steady_clock::now();
+				stepInterval = duration<double>(now - lastStepDone).count();
+				lastStepDone = now;
+				swap(displaySources, stepSources);
+				swap(displayResults, stepResults);
+				displaySubsteps = stepSubsteps;
+				nbodyList = displayResults;
+				simulatedSteps += stepSubsteps;
+				if (trajectory.isOpen() && (trajectory.getFrameCount() == 0 || simulatedSteps - lastRecordedStep >= trajectoryEvery))
+				{
+					trajectory.record(nbodyList, simulatedSteps);
+					lastRecordedStep = simulatedSteps;
+				}
+				if (exporter.isOpen() && (exporter.framesQueued == 0 || simulatedSteps - lastExportStep >= exportEvery))
+				{
+					exporter.submit(nbodyList, exportView);
+					lastExportStep = simulatedSteps;
+					if (exportFrames > 0 && exporter.framesQueued >= exportFrames)
+						exporter.close();
+				}
+				if (rewindMemory > 0 && (rewindRing.size() == 0 || simulatedSteps - lastRewindStep >= rewindEvery))
+				{
+					rewindRing.record(nbodyList, simulatedSteps);
+					lastRewindStep = simulatedSteps;
+				}
+				if (checkpointEvery > 0 && duration<double>(now - lastCheckpoint).count() >= checkpointEvery)
 				{
-					rootScaleX = rootDist*xOff/dist;
-					rootScaleY = rootDist*yOff/dist;
+					snapshots.save(partialLoad ? "checkpoint_region.csv" : "checkpoint.csv", nbodyList, fieldSeeds);
+					lastCheckpoint = now;
 				}
 
-				circleCoords = getCirclePoints((double)width/2 + rootScaleX, (double)height/2 + rootScaleY, 20, curBody.radius);
+				//Merged bodies are inert, they only need clearing out once there are enough of them to slow the steps down
+				int dead = count_if(nbodyList.begin(), nbodyList.end(), [](const nbody& curBody) { return curBody.dead; });
+				if (dead > nbodyList.size()/8)
+					nbodyList.erase(remove_if(nbodyList.begin(), nbodyList.end(), [](const nbody& curBody) { return curBody.dead; }), nbodyList.end());
+				publishedSize = nbodyList.size();
 			}
 			else
+				publishedSize = -1;
+		}
+
+		if (!stepRunning && solver != NULL && scrubIndex < 0)
+		{
+			if (backendReady)
+				engine.pipelined = pipelined;
+			stepSources = nbodyList;
+			stepResults = nbodyList;
+			stepSubsteps = substeps;
+			int count = substeps;
+			stepTask = async(launch::async, [solver, &stepResults, count]()
 			{
-				SDL_Point normal;
-				normal.x = -cameraOffsetX + curBody.x;
-				normal.y = -cameraOffsetY + curBody.y;
-				SDL_Point scaled;
-				scaled.x = (normal.x - width/2)*scale + width/2;
-				scaled.y = (normal.y - height/2)*scale + height/2;
-				circleCoords = getCirclePoints(scaled.x, scaled.y, 20, curBody.radius*scale);
-				vector<SDL_Point> velVec;
-				SDL_Point start, end;
-				start.x = scaled.x;
-				start.y = scaled.y;
-				end.x = scaled.x + curBody.velX;
-				end.y = scaled.y + curBody.velY;
-				velVec.push_back(start);
-				velVec.push_back(end);
-				SDL_SetRenderDrawColor(ren, 0xFF, 0x00, 0x00, 0xFF);
-				SDL_RenderDrawLines(ren, velVec.data(), velVec.size());
-			}
-			
-			SDL_SetRenderDrawColor(ren, 0xFF, 0xFF, 0xFF, 0xFF);
-			SDL_RenderDrawLines(ren, circleCoords.data(), circleCoords.size());
+				steady_clock::time_point start = steady_clock::now();
+				solver->stepMany(&stepResults, count);
+				return duration<double>(steady_clock::now() - start).count();
+			});
+			stepRunning = true;
+		}
+
+		//printTotalMomentum(&nbodyList);
+
+		//Anything done to nbodyList since the last step finished shows up straight away rather than after the next one
+		const vector<nbody>* drawList = &nbodyList;
+		if (interpolation > 0 && stepInterval > 0 && publishedSize == nbodyList.size())
+		{
+			double alpha = min(1.0, duration<double>(steady_clock::now() - lastStepDone).count()/stepInterval);
+			interpolateBodies(displaySources, displayResults, alpha, interpolation == 2, timeStep*displaySubsteps, &displayList);
+			drawList = &displayList;
 		}
 
+		ViewTransform view;
+		view.width = width;
+		view.height = height;
+		view.cameraOffsetX = cameraOffsetX;
+		view.cameraOffsetY = cameraOffsetY;
+		view.scale = scale;
+		view.rootScale = rootScale;
+		if (densityMode)
+			densityRenderer.draw(ren, *drawList, view);
+		else
+			bodyRenderer.draw(ren, *drawList, view);
 
 		if (rootScale)
 		{
@@ -626,8 +850,8 @@ int main(int argc, char** argv)
 			SDL_RenderDrawLines(ren, logWindowPoints.data(), logWindowPoints.size());
 		}
 
-		int ret = SDL_PollEvent(&event);
-		if (ret)
+		//Everything queued since the last frame is handled now, so input never lags behind by more than a frame
+		while (SDL_PollEvent(&event))
 		{
 			if (event.type == SDL_QUIT)
 				running = false;
@@ -642,10 +866,10 @@ int main(int argc, char** argv)
 					scale /= .95;
 				}
 			}
-			//else if (event.type == SDL_MOUSEBUTTONDOWN)
-			//{
-			//	bool ret = mainMenu.captureInput(event);
-			//}
+			else if (event.type == SDL_MOUSEBUTTONDOWN)
+			{
+				mainMenu.captureInput(event);
+			}
 		}
 
 		const Uint8* keystate = SDL_GetKeyboardState(NULL);
@@ -654,11 +878,13 @@ int main(int argc, char** argv)
 		double moveDiff = 3;
 		Uint32 mouseState = SDL_GetMouseState(&mouseX, &mouseY);
 
-		mainMenu.render(mainMenu.x, mainMenu.y, mouseX, mouseY);
+		mainMenu.renderCached(mouseX, mouseY);
 
 		if (keystate[SDL_SCANCODE_C])
 		{
 			nbodyList.clear();
+			fieldSeeds.clear();
+			partialLoad = false;
 		}
 		else if (keystate[SDL_SCANCODE_R])
 		{
@@ -687,17 +913,51 @@ int main(int argc, char** argv)
 		}
 		else if (keystate[SDL_SCANCODE_A] && !buttonFlag)
 		{
-			makeAccDisk(40000, height*10, 200000, mainWin, &nbodyList);
+			makeAccDisk(40000, height*10, 200000, (double)width/2, (double)height/2, nextSeed, &nbodyList);
+			fieldSeeds.assign(1, nextSeed++);
+			buttonFlag = true;
+		}
+		else if (keystate[SDL_SCANCODE_K] && !buttonFlag)
+		{
+			nbodyList.clear();
+			partialLoad = false;
+			makePlummer(40000, height, 10*height, (double)width/2, (double)height/2, 0, 0, nextSeed, &nbodyList);
+			fieldSeeds.assign(1, nextSeed++);
+			buttonFlag = true;
+		}
+		else if (keystate[SDL_SCANCODE_E] && !buttonFlag)
+		{
+			nbodyList.clear();
+			partialLoad = false;
+			makeExponentialDisk(40000, 2*height, .15, 10000, (double)width/2, (double)height/2, 0, 0, 1, nextSeed, &nbodyList);
+			fieldSeeds.assign(1, nextSeed++);
+			buttonFlag = true;
+		}
+		else if (keystate[SDL_SCANCODE_M] && !buttonFlag)
+		{
+			nbodyList.clear();
+			partialLoad = false;
+			makeGalaxyCollision(40000, height, 12*height, (double)width/2, (double)height/2, nextSeed, &nbodyList);
+			fieldSeeds.assign(1, nextSeed++);
 			buttonFlag = true;
 		}
 		else if (keystate[SDL_SCANCODE_F] && !buttonFlag)
 		{
-			saveNBodyList(&nbodyList);
+			if (partialLoad)
+			{
+				snapshots.save("nbody_region.csv", nbodyList, fieldSeeds);
+				std::cout << "Only the bodies in view of nbody.csv are loaded, saved them to nbody_region.csv to keep nbody.csv whole\n";
+			}
+			else
+				snapshots.save("nbody.csv", nbodyList, fieldSeeds);
 			buttonFlag = true;
 		}
 		else if (keystate[SDL_SCANCODE_G] && !buttonFlag)
 		{
-			loadNBodyList(&nbodyList);
+			//A save that is still being written would otherwise load the file from before it
+			snapshots.waitUntilIdle();
+			bool shift = (SDL_GetModState() & KMOD_SHIFT) != 0;
+			loadNBodyList("nbody.csv", &nbodyList, &fieldSeeds, shift ? NULL : &view, regionThreshold, &partialLoad);
 			buttonFlag = true;
 		}
 		else if (keystate[SDL_SCANCODE_L])
@@ -707,12 +967,127 @@ int main(int argc, char** argv)
 				rootScale = !rootScale;
 			buttonFlag = true;
 		}
+		else if (keystate[SDL_SCANCODE_D] && !buttonFlag)
+		{
+			densityMode = !densityMode;
+			buttonFlag = true;
+		}
+		else if (keystate[SDL_SCANCODE_I] && !buttonFlag)
+		{
+			interpolation = (interpolation + 1) % 3;
+			string modes[] = {"off", "interpolating", "extrapolating"};
+			std::cout << "Smoothing between steps " << modes[interpolation] << "\n";
+			buttonFlag = true;
+		}
+		else if (keystate[SDL_SCANCODE_PERIOD] && !buttonFlag)
+		{
+			autoSubsteps = false;
+			substeps = min(maxSubsteps, substeps*2);
+			std::cout << "Time warp: " << substeps << " steps per batch\n";
+			buttonFlag = true;
+		}
+		else if (keystate[SDL_SCANCODE_COMMA] && !buttonFlag)
+		{
+			autoSubsteps = false;
+			substeps = max(1, substeps/2);
+			std::cout << "Time warp: " << substeps << " steps per batch\n";
+			buttonFlag = true;
+		}
+		else if (keystate[SDL_SCANCODE_W] && !buttonFlag)
+		{
+			autoSubsteps = !autoSubsteps;
+			std::cout << "Automatic time warp " << (autoSubsteps ? "on" : "off") << "\n";
+			buttonFlag = true;
+		}
+		else if (keystate[SDL_SCANCODE_O] && !buttonFlag)
+		{
+			pipelined = !pipelined;
+			std::cout << "Pipelined stepping " << (pipelined ? "on" : "off") << "\n";
+			buttonFlag = true;
+		}
+		else if (keystate[SDL_SCANCODE_LEFTBRACKET] && rewindRing.size() > 0)
+		{
+			//Held down it scrubs back one snapshot a frame
+			if (scrubIndex < 0)
+				std::cout << "Rewinding, " << rewindRing.size() << " snapshots from step " << rewindRing.getStep(0) << " to " << rewindRing.getStep(rewindRing.size() - 1) << ". Enter carries on from the one shown\n";
+			int target = scrubIndex < 0 ? rewindRing.size() - 1 : max(0, scrubIndex - 1);
+			//A snapshot that won't decode leaves the bodies and the scrub position where they were
+			if (rewindRing.restore(target, &nbodyList))
+			{
+				scrubIndex = target;
+				simulatedSteps = rewindRing.getStep(scrubIndex);
+				publishedSize = -1;
+			}
+			else
+				std::cout << "Couldn't restore the snapshot from step " << rewindRing.getStep(target) << "\n";
+		}
+		else if (keystate[SDL_SCANCODE_RIGHTBRACKET] && scrubIndex >= 0)
+		{
+			int target = min(rewindRing.size() - 1, scrubIndex + 1);
+			if (rewindRing.restore(target, &nbodyList))
+			{
+				scrubIndex = target;
+				simulatedSteps = rewindRing.getStep(scrubIndex);
+				publishedSize = -1;
+			}
+			else
+				std::cout << "Couldn't restore the snapshot from step " << rewindRing.getStep(target) << "\n";
+		}
+		else if (keystate[SDL_SCANCODE_RETURN] && scrubIndex >= 0)
+		{
+			//The snapshots after this one are from the timeline being left
+			rewindRing.truncate(scrubIndex);
+			lastRewindStep = simulatedSteps;
+			std::cout << "Carrying on from step " << simulatedSteps << "\n";
+			//A trajectory's steps only go up, so one that already went past here carries on in a file of its own
+			if (trajectory.isOpen() && trajectory.getFrameCount() > 0 && lastRecordedStep > simulatedSteps)
+			{
+				trajectory.close();
+				std::cout << "Stopped recording, " << trajectory.getFrameCount() << " steps in " << trajectoryPath << "\n";
+				trajectoryPath = getSegmentPath(trajectoryPath, simulatedSteps);
+				if (trajectory.open(trajectoryPath))
+					std::cout << "Recording every " << trajectoryEvery << " steps to " << trajectoryPath << "\n";
+			}
+			lastRecordedStep = simulatedSteps;
+			lastExportStep = simulatedSteps;
+			scrubIndex = -1;
+		}
+		else if (keystate[SDL_SCANCODE_T] && !buttonFlag)
+		{
+			if (trajectory.isOpen())
+			{
+				trajectory.close();
+				std::cout << "Stopped recording, " << trajectory.getFrameCount() << " steps in " << trajectoryPath << "\n";
+			}
+			else if (trajectory.open(trajectoryPath))
+				std::cout << "Recording every " << trajectoryEvery << " steps to " << trajectoryPath << "\n";
+			buttonFlag = true;
+		}
+		else if (keystate[SDL_SCANCODE_X] && !buttonFlag)
+		{
+			if (exporter.isOpen())
+				exporter.close();
+			else
+				startExport();
+			buttonFlag = true;
+		}
+		else if (keystate[SDL_SCANCODE_V] && !buttonFlag)
+		{
+			//vsync is fixed once the renderer exists, otherwise this switches between the frame rate cap and uncapped
+			if (frameScheduler.mode == FRAME_TARGET)
+				frameScheduler.mode = FRAME_UNCAPPED;
+			else if (frameScheduler.mode == FRAME_UNCAPPED)
+				frameScheduler.mode = FRAME_TARGET;
+			std::cout << "Frame pacing: " << frameScheduler.getDescription() << "\n";
+			buttonFlag = true;
+		}
 		else if (keystate[SDL_SCANCODE_P] && !buttonFlag)
 		{
-			placeRandomField(40000, 5, 10*height, mainWin, &nbodyList);
+			placeRandomField(40000, 5, 10*height, (double)width/2, (double)height/2, nextSeed, &nbodyList);
+			fieldSeeds.push_back(nextSeed++);
 			buttonFlag = true;
 		}
-		else if (mouseState && !placingBody)
+		else if (mouseState && !placingBody && mainMenu.getItemAt(mainMenu.x, mainMenu.y, mouseX, mouseY) == nullptr)
 		{
 			placingBody = true;
 			leftClick = true;
@@ -728,6 +1103,7 @@ int main(int argc, char** argv)
 		else if (mouseState == 0 && placingBody)
 		{
 			nbody newBody = getNewNBody(-cameraOffsetX + newX, -cameraOffsetY + newY, (double)(newX-dX)/20, (double)(newY-dY)/20, 1, staticBody);
+			assignBodyIds(&newBody, 1);
 			nbodyList.push_back(newBody);
 
 			leftClick = false;
@@ -759,9 +1135,13 @@ int main(int argc, char** argv)
 		//SDL_RenderCopy(ren, texture, NULL, &dest);
 		//Update screen
 		SDL_RenderPresent(ren);
-		Sleep(1);
+		frameScheduler.endFrame();
 	}
 
+	//A long batch may still be writing into stepResults
+	if (stepRunning)
+		stepTask.wait();
+	closeTextCache();
 	TTF_Quit();
 	SDL_DestroyWindow(mainWin);
 	SDL_Quit();
@@ -0,0 +1,422 @@
+#ifndef NBODY_H
+#define NBODY_H
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <CL/cl.hpp>
+#include <thread>
+#include <functional>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+
+using namespace std;
+
+//Gravitational constant, a mass of 1 is equivalent to 1kg
+//double G = 6.67408E-11f;
+//double unitMass = 1.5*pow(10, 10);
+//Toy constant, a mass of 1 is equivalent to asteroid size  ~15 billion kg
+double G = 1;
+double unitMass = 1;
+//Simulated time each step advances, the simple_add kernel has the same value
+const double timeStep = .1;
+//Caps the threads parallelFor uses, 0 uses every hardware thread
+int maxThreads = 0;
+//Next id assignBodyIds hands out, 0 is left for bodies that haven't been given one
+//Atomic since calibration fills fields on the background init thread while the main thread makes its own
+atomic<uint32_t> nextBodyId(1);
+
+struct __attribute__ ((packed)) nbody
+{
+	cl_double x;
+	cl_double y;
+	cl_double velX;
+	cl_double velY;
+	cl_double radius;
+	cl_int mass;
+	//Stays with the body for its whole life however the list is reordered or compacted, trajectories are keyed by it
+	cl_uint id;
+	bool staticBody;
+	bool dead;
+};
+
+nbody getNewNBody(double newX, double newY, double dX, double dY, int unitMasses, bool staticFlag)
+{
+	nbody newNBody;
+	newNBody.x = newX;
+	newNBody.y = newY;
+	newNBody.velX = dX;
+	newNBody.velY = dY;
+	//By basing the mass and radius on a standard unit we can scale to large and small by changing the unit mass
+	newNBody.mass = unitMass*unitMasses;
+	newNBody.radius = 1.0;
+	if (unitMasses > 1)
+		newNBody.radius *= cbrt(unitMasses);
+
+	newNBody.staticBody = staticFlag;
+	newNBody.dead = false;
+	newNBody.id = 0;
+
+	return newNBody;
+}
+
+//Gives each of count new bodies the next id in order, done after a field is filled so ids don't depend on thread timing
+//The whole range is reserved at once, so fields filled on two threads at the same time never share an id
+void assignBodyIds(nbody* bodies, int count)
+{
+	uint32_t first = nextBodyId.fetch_add(count);
+	for (int i=0;i<count;i++)
+		bodies[i].id = first + i;
+}
+
+int getThreadCount()
+{
+	int threads = max(1, (int)thread::hardware_concurrency());
+	return maxThreads > 0 ? min(maxThreads, threads) : threads;
+}
+
+int getParallelChunkCount(int count)
+{
+	return max(1, min(getThreadCount(), count));
+}
+
+//Worker threads parallelFor shares out chunks to, started once and kept for the life of the program instead of starting
+//threads on every call. The calling thread works through its own chunks too and only waits for ones already taken, so calls
+//made from several threads at once, or from inside a chunk, always finish even when every worker is busy
+class ThreadPool
+{
+public:
+	struct Job
+	{
+		function<void(int, int, int)>* fn;
+		int count;
+		int chunkCount;
+		int nextChunk;
+		int chunksDone;
+	};
+
+	ThreadPool(int workerCount)
+	{
+		for (int w=0;w<workerCount;w++)
+			thread(&ThreadPool::work, this).detach();
+	}
+
+	void run(function<void(int, int, int)>& fn, int count, int chunkCount)
+	{
+		Job job = {&fn, count, chunkCount, 0, 0};
+		unique_lock<mutex> guard(this->lock);
+		this->jobs.push_back(&job);
+		this->wake.notify_all();
+		for (int c=job.nextChunk++;c<chunkCount;c=job.nextChunk++)
+			this->runChunk(&job, c, guard);
+		this->done.wait(guard, [&job]() { return job.chunksDone == job.chunkCount; });
+		//Workers only look at a job under the lock, so once it's out of the list nothing refers to it
+		this->jobs.erase(find(this->jobs.begin(), this->jobs.end(), &job));
+	}
+
+private:
+	mutex lock;
+	condition_variable wake;
+	condition_variable done;
+	vector<Job*> jobs;
+
+	//Called and returns with the lock held, it's let go while fn runs
+	void runChunk(Job* job, int c, unique_lock<mutex>& guard)
+	{
+		guard.unlock();
+		(*job->fn)(c, (int)((long long)job->count*c/job->chunkCount), (int)((long long)job->count*(c+1)/job->chunkCount));
+		guard.lock();
+		if (++job->chunksDone == job->chunkCount)
+			this->done.notify_all();
+	}
+
+	void work()
+	{
+		unique_lock<mutex> guard(this->lock);
+		while (true)
+		{
+			Job* job = NULL;
+			for (int j=0;j<this->jobs.size() && job == NULL;j++)
+				if (this->jobs[j]->nextChunk < this->jobs[j]->chunkCount)
+					job = this->jobs[j];
+			if (job == NULL)
+			{
+				this->wake.wait(guard);
+				continue;
+			}
+			this->runChunk(job, job->nextChunk++, guard);
+		}
+	}
+};
+
+//Splits [0, count) into one contiguous chunk per hardware thread and runs fn(chunk, start, stop) on each
+void parallelFor(int count, function<void(int, int, int)> fn)
+{
+	//Never destroyed, threads still in a call when the program exits would otherwise be using a pool that's gone
+	static ThreadPool* pool = new ThreadPool(max(1, (int)thread::hardware_concurrency()) - 1);
+	int chunkCount = getParallelChunkCount(count);
+	if (chunkCount == 1)
+		fn(0, 0, count);
+	else
+		pool->run(fn, count, chunkCount);
+}
+
+//Philox4x32-10 counter based generator: the same (counter, key) always gives the same 128 random bits,
+//so body i's random numbers depend only on the seed and i, never on which thread made them or in what order
+inline void philox4x32(uint64_t counter, uint64_t key, uint32_t out[4])
+{
+	uint32_t c0 = (uint32_t)counter, c1 = (uint32_t)(counter >> 32), c2 = 0, c3 = 0;
+	uint32_t k0 = (uint32_t)key, k1 = (uint32_t)(key >> 32);
+	for (int round=0;round<10;round++)
+	{
+		uint64_t product0 = (uint64_t)0xD2511F53*c0;
+		uint64_t product1 = (uint64_t)0xCD9E8D57*c2;
+		uint32_t n0 = (uint32_t)(product1 >> 32) ^ c1 ^ k0;
+		uint32_t n2 = (uint32_t)(product0 >> 32) ^ c3 ^ k1;
+		c1 = (uint32_t)product1;
+		c3 = (uint32_t)product0;
+		c0 = n0;
+		c2 = n2;
+		k0 += 0x9E3779B9;
+		k1 += 0xBB67AE85;
+	}
+
+	out[0] = c0;
+	out[1] = c1;
+	out[2] = c2;
+	out[3] = c3;
+}
+
+//Maps 32 random bits to (0, 1)
+inline double uniformFromBits(uint32_t bits)
+{
+	return (bits + .5)/4294967296.0;
+}
+
+//Uniform field of unit masses within radius of the center, each moving at velocity in a random direction
+//Appended to the list, body i of the field is the same for a given seed no matter how many threads fill it
+void placeRandomField(int massCount, double velocity, double radius, double centerX, double centerY, uint64_t seed, vector<nbody>* nbodyList)
+{
+	int first = nbodyList->size();
+	nbodyList->resize(first + massCount);
+	nbody* field = nbodyList->data() + first;
+
+	parallelFor(massCount, [&](int chunk, int start, int stop)
+	{
+		uint32_t bits[4];
+		for (int i=start; i<stop; i++)
+		{
+			philox4x32(i, seed, bits);
+			double dist = uniformFromBits(bits[0])*radius;
+			double placeAngle = uniformFromBits(bits[1])*2*3.1415926;
+			double x = cos(placeAngle) * dist + centerX;
+			double y = sin(placeAngle) * dist + centerY;
+			double angle = uniformFromBits(bits[2])*2*3.1415926;
+			double newVelX = cos(angle)*velocity;
+			double newVelY = sin(angle)*velocity;
+			field[i] = getNewNBody(x, y, newVelX, newVelY, 1, false);
+		}
+	});
+	assignBodyIds(field, massCount);
+}
+
+//Static central mass at the center with unit masses on circular orbits around it, replaces the list
+void makeAccDisk(int massCount, double radius, double centerMass, double centerX, double centerY, uint64_t seed, vector<nbody>* nbodyList)
+{
+	nbodyList->resize(massCount + 1);
+	nbody* field = nbodyList->data();
+	field[0] = getNewNBody(centerX, centerY, 0, 0, centerMass, true);
+
+	parallelFor(massCount, [&](int chunk, int start, int stop)
+	{
+		uint32_t bits[4];
+		for (int i=start; i<stop; i++)
+		{
+			philox4x32(i, seed, bits);
+			double newDist = uniformFromBits(bits[0])*radius+50;
+			double newAngle = uniformFromBits(bits[1])*2*3.1415926;
+			double dX = cos(newAngle)*newDist;
+			double dY = sin(newAngle)*newDist;
+			double totalVel = sqrt((centerMass*G)/newDist);
+			double tanAngle = atan2(-dY, dX);
+			double newVelX = sin(tanAngle)*totalVel;
+			double newVelY = cos(tanAngle)*totalVel;
+			field[i + 1] = getNewNBody(dX + centerX, dY + centerY, newVelX, newVelY, 1, false);
+		}
+	});
+	assignBodyIds(field, massCount + 1);
+}
+
+//Tabulated axisymmetric profile for the clustered generators. Radii are drawn by inverting the enclosed mass,
+//and the gravity and velocity dispersion that keep the profile in equilibrium are looked up by radius
+//Gravity is taken from the enclosed mass alone, which is what a body orbiting in the plane mostly feels
+struct RadialProfile
+{
+	double binWidth;
+	double totalMass;
+	double pointMass;
+	//All indexed by bin k, at radius (k+1)*binWidth
+	vector<double> enclosed;
+	vector<double> density;
+	//Squared radial velocity dispersion that holds the profile up against its own gravity (isotropic Jeans equation)
+	vector<double> dispersion;
+
+	//surfaceDensity doesn't need to be normalized, nothing is placed beyond maxRadius
+	//pointMass is a central body on top of the profile that only contributes gravity
+	RadialProfile(function<double(double)> surfaceDensity, double maxRadius, double argTotalMass, double argPointMass, int bins = 4096)
+	{
+		this->binWidth = maxRadius/bins;
+		this->totalMass = argTotalMass;
+		this->pointMass = argPointMass;
+		this->enclosed.resize(bins);
+		this->density.resize(bins);
+		this->dispersion.resize(bins);
+
+		double mass = 0;
+		double lastRing = 0;
+		for (int k=0;k<bins;k++)
+		{
+			double r = (k + 1)*this->binWidth;
+			this->density[k] = surfaceDensity(r);
+			double ring = 2*3.1415926*r*this->density[k];
+			mass += (ring + lastRing)/2*this->binWidth;
+			lastRing = ring;
+			this->enclosed[k] = mass;
+		}
+
+		for (int k=0;k<bins;k++)
+			this->enclosed[k] /= mass;
+
+		//Integrated inwards from the edge where the pressure is zero
+		double pressure = 0;
+		for (int k=bins-1;k>=0;k--)
+		{
+			pressure += this->density[k]*this->getGravity((k + 1)*this->binWidth)*this->binWidth;
+			this->dispersion[k] = this->density[k] > 0 ? pressure/this->density[k] : 0;
+		}
+	}
+
+	double lookup(const vector<double>& table, double r)
+	{
+		double k = r/this->binWidth - 1;
+		if (k <= 0)
+			return table[0];
+		if (k >= table.size() - 1)
+			return table.back();
+		int i = (int)k;
+		return table[i] + (table[i+1] - table[i])*(k - i);
+	}
+
+	//Inward acceleration at radius r
+	double getGravity(double r)
+	{
+		return G*(this->pointMass + this->totalMass*this->lookup(this->enclosed, r))/(r*r);
+	}
+
+	//The radius inside which a fraction u of the mass lies
+	double sampleRadius(double u)
+	{
+		int k = upper_bound(this->enclosed.begin(), this->enclosed.end(), u) - this->enclosed.begin();
+		if (k >= this->enclosed.size())
+			return this->enclosed.size()*this->binWidth;
+		double below = k > 0 ? this->enclosed[k-1] : 0;
+		double t = (u - below)/max(this->enclosed[k] - below, 1e-300);
+		return (k + t)*this->binWidth;
+	}
+};
+
+//Standard normal pair from two uniforms (Box-Muller)
+inline void gaussianPair(double u1, double u2, double* g1, double* g2)
+{
+	double magnitude = sqrt(-2*log(u1));
+	*g1 = magnitude*cos(2*3.1415926*u2);
+	*g2 = magnitude*sin(2*3.1415926*u2);
+}
+
+//Plummer sphere seen face on: surface density (1 + r^2/a^2)^-2, cut off at truncationRadius like a tidally limited (King-like) cluster
+//Held up by random velocities alone. Appended to the list, moving with velX, velY as a whole
+void makePlummer(int massCount, double scaleRadius, double truncationRadius, double centerX, double centerY, double velX, double velY, uint64_t seed, vector<nbody>* nbodyList)
+{
+	RadialProfile profile([&](double r) { double q = 1 + r*r/(scaleRadius*scaleRadius); return 1/(q*q); }, truncationRadius, massCount*unitMass, 0);
+
+	int first = nbodyList->size();
+	nbodyList->resize(first + massCount);
+	nbody* field = nbodyList->data() + first;
+
+	parallelFor(massCount, [&](int chunk, int start, int stop)
+	{
+		uint32_t bits[4];
+		for (int i=start; i<stop; i++)
+		{
+			philox4x32(i, seed, bits);
+			double dist = profile.sampleRadius(uniformFromBits(bits[0]));
+			double placeAngle = uniformFromBits(bits[1])*2*3.1415926;
+			double sigma = sqrt(profile.lookup(profile.dispersion, dist));
+			double g1, g2;
+			gaussianPair(uniformFromBits(bits[2]), uniformFromBits(bits[3]), &g1, &g2);
+			field[i] = getNewNBody(cos(placeAngle)*dist + centerX, sin(placeAngle)*dist + centerY, velX + g1*sigma, velY + g2*sigma, 1, false);
+		}
+	});
+	assignBodyIds(field, massCount);
+}
+
+//Exponential disk, surface density exp(-r/h), out to 6 scale lengths around a central mass that moves with it
+//Bodies orbit at the circular speed less a random radial and tangential velocity of dispersion times that speed,
+//the mean rotation is slowed by the asymmetric drift the dispersion needs, so the disk neither collapses nor puffs up
+//spin is 1 for counterclockwise (the same way 'A' disks turn) or -1 for clockwise. Appended to the list
+void makeExponentialDisk(int massCount, double scaleLength, double dispersion, double centralMass, double centerX, double centerY, double velX, double velY, int spin, uint64_t seed, vector<nbody>* nbodyList)
+{
+	RadialProfile profile([&](double r) { return exp(-r/scaleLength); }, 6*scaleLength, massCount*unitMass, centralMass*unitMass);
+
+	int first = nbodyList->size();
+	nbodyList->resize(first + massCount + 1);
+	nbody* field = nbodyList->data() + first;
+	field[0] = getNewNBody(centerX, centerY, velX, velY, centralMass, false);
+
+	parallelFor(massCount, [&](int chunk, int start, int stop)
+	{
+		uint32_t bits[4];
+		for (int i=start; i<stop; i++)
+		{
+			philox4x32(i, seed, bits);
+			//Starting outside the central mass's radius so it doesn't swallow the middle of the disk on the first step
+			double dist = profile.sampleRadius(uniformFromBits(bits[0])) + field[0].radius;
+			double placeAngle = uniformFromBits(bits[1])*2*3.1415926;
+			double dX = cos(placeAngle)*dist;
+			double dY = sin(placeAngle)*dist;
+
+			double circular = dist*profile.getGravity(dist);
+			double sigma = dispersion*sqrt(circular);
+			double rotation = sqrt(max(0.0, circular - sigma*sigma*dist/scaleLength));
+			double g1, g2;
+			gaussianPair(uniformFromBits(bits[2]), uniformFromBits(bits[3]), &g1, &g2);
+			double radial = g1*sigma;
+			double tangential = spin*(rotation + g2*sigma);
+			double newVelX = (dX*radial - dY*tangential)/dist;
+			double newVelY = (dY*radial + dX*tangential)/dist;
+			field[i + 1] = getNewNBody(dX + centerX, dY + centerY, velX + newVelX, velY + newVelY, 1, false);
+		}
+	});
+	assignBodyIds(field, massCount + 1);
+}
+
+//Two exponential disks of massCount/2 bodies each falling towards each other, offset by a quarter of the separation so they
+//pass off center, at 70% of the speed that would just let them escape. The second disk spins the other way. Appended to the list
+void makeGalaxyCollision(int massCount, double scaleLength, double separation, double centerX, double centerY, uint64_t seed, vector<nbody>* nbodyList)
+{
+	int half = massCount/2;
+	double centralMass = half/4;
+	double galaxyMass = (half + centralMass)*unitMass;
+	double approach = .7*sqrt(2*G*2*galaxyMass/separation)/2;
+
+	makeExponentialDisk(half, scaleLength, .15, centralMass, centerX - separation/2, centerY - separation/8, approach, 0, 1, seed, nbodyList);
+	//Bodies of the second disk use a different key so the two disks aren't copies of each other
+	makeExponentialDisk(massCount - half, scaleLength, .15, centralMass, centerX + separation/2, centerY + separation/8, -approach, 0, -1, seed ^ 0x5DEECE66DULL, nbodyList);
+}
+
+#endif
@@ -0,0 +1,471 @@
+#ifndef RENDER_H
+#define RENDER_H
+
+#include "SDL/include/SDL.h"
+#include "nbody.h"
+#include <atomic>
+#include <memory>
+
+//Adds the outline of a circle as a closed strip of numPoints+1 points for SDL_RenderDrawLines
+void appendCirclePoints(vector<SDL_Point>* circleCoords, int xOff, int yOff, int numPoints, double radius)
+{
+	double deltaPhi = 2*3.1415926/numPoints;
+	for (int i=0; i<numPoints+1; i++)
+	{
+		double tempX = radius * cos(deltaPhi * i);
+		double tempY = radius * sin(deltaPhi * i);
+		SDL_Point tempCoord;
+		tempCoord.x = tempX + xOff;
+		tempCoord.y = tempY + yOff;
+
+		circleCoords->push_back(tempCoord);
+	}
+}
+
+vector<SDL_Point> getCirclePoints(int xOff, int yOff, int numPoints, double radius)
+{
+	vector<SDL_Point> circleCoords;
+	appendCirclePoints(&circleCoords, xOff, yOff, numPoints, radius);
+	return circleCoords;
+}
+
+//The camera the bodies are drawn through
+struct ViewTransform
+{
+	int width;
+	int height;
+	double cameraOffsetX;
+	double cameraOffsetY;
+	double scale;
+	//It can be hard to see multiple planets in orbit so root scale draws each body at the square root of its distance from the center of the screen
+	bool rootScale;
+
+	//Where on screen the center of body lands and how big it is there
+	void project(const nbody& body, double* screenX, double* screenY, double* screenRadius) const
+	{
+		if (this->rootScale)
+		{
+			//Get the offset from the center of the screen
+			double xOff = body.x - (this->cameraOffsetX + (double)this->width/2);
+			double yOff = body.y - (this->cameraOffsetY + (double)this->height/2);
+			//Get the distance from the center of the screen
+			double dist = sqrt(xOff*xOff + yOff*yOff);
+			//Get the root distance and split it into its components
+			double rootDist = sqrt(dist);
+			double rootScaleX = 0, rootScaleY = 0;
+			if (rootDist > 0)
+			{
+				rootScaleX = rootDist*xOff/dist;
+				rootScaleY = rootDist*yOff/dist;
+			}
+
+			*screenX = (double)this->width/2 + rootScaleX;
+			*screenY = (double)this->height/2 + rootScaleY;
+			*screenRadius = body.radius;
+		}
+		else
+		{
+			*screenX = (body.x - this->cameraOffsetX - this->width/2)*this->scale + this->width/2;
+			*screenY = (body.y - this->cameraOffsetY - this->height/2)*this->scale + this->height/2;
+			*screenRadius = body.radius*this->scale;
+		}
+	}
+
+	//The area of the simulation on screen, false under root scale where everything can be
+	bool getVisibleBounds(double* minX, double* minY, double* maxX, double* maxY) const
+	{
+		if (this->rootScale)
+			return false;
+		double centerX = this->cameraOffsetX + (double)this->width/2;
+		double centerY = this->cameraOffsetY + (double)this->height/2;
+		*minX = centerX - this->width/(2*this->scale);
+		*maxX = centerX + this->width/(2*this->scale);
+		*minY = centerY - this->height/(2*this->scale);
+		*maxY = centerY + this->height/(2*this->scale);
+		return true;
+	}
+};
+
+//Positions to draw between two steps. sources went into the last step and results came out of it, so they share indices
+//Interpolating moves from sources at alpha 0 to results at 1, a step behind the simulation. Extrapolating moves on from
+//results along their velocities for up to stepTime instead, which shows the latest step right away but overshoots where paths curve
+void interpolateBodies(const vector<nbody>& sources, const vector<nbody>& results, double alpha, bool extrapolate, double stepTime, vector<nbody>* display)
+{
+	int n = results.size();
+	display->resize(n);
+	parallelFor(n, [&](int chunk, int start, int stop)
+	{
+		for (int i=start;i<stop;i++)
+		{
+			nbody curBody = results[i];
+			if (extrapolate)
+			{
+				curBody.x += curBody.velX*stepTime*alpha;
+				curBody.y += curBody.velY*stepTime*alpha;
+			}
+			else
+			{
+				curBody.x = sources[i].x + (curBody.x - sources[i].x)*alpha;
+				curBody.y = sources[i].y + (curBody.y - sources[i].y)*alpha;
+			}
+			display->at(i) = curBody;
+		}
+	});
+}
+
+//Draws the body list with the work scaling with what is on screen rather than with the number of bodies
+//Bodies are projected in parallel, anything off screen is dropped, bodies too small to have an outline are counted into
+//the pixel they land in and every lit pixel is drawn once, shaded by how many bodies are in it
+class BodyRenderer
+{
+public:
+	//Bodies with a smaller radius on screen than this are drawn as points
+	double pointRadius = 1;
+	//Outline segments for the biggest bodies, small ones get fewer
+	int maxCircleSegments = 20;
+
+	//Number of point bodies in each pixel this frame
+	unique_ptr<atomic<uint32_t>[]> pixelCounts;
+	size_t pixelCount = 0;
+	//Everything below is filled per chunk so threads never share a vector
+	//Outlines as strips of circleSizes[c][k] points each, one after the other
+	vector<vector<SDL_Point>> circlePoints;
+	vector<vector<int>> circleSizes;
+	//Start and end of each velocity line
+	vector<vector<SDL_Point>> velocityLines;
+	//Lit pixels split by how many bodies landed in them, see getShade
+	static const int shadeCount = 4;
+	vector<vector<SDL_Point>> pixelPoints[shadeCount];
+
+	//Brighter the more bodies share a pixel: 1, 2-3, 4-15, 16 or more
+	static int getShade(uint32_t bodies)
+	{
+		if (bodies >= 16)
+			return 3;
+		if (bodies >= 4)
+			return 2;
+		if (bodies >= 2)
+			return 1;
+		return 0;
+	}
+
+	void draw(SDL_Renderer* ren, const vector<nbody>& nbodyList, const ViewTransform& view)
+	{
+		int width = view.width;
+		int height = view.height;
+		if (width <= 0 || height <= 0)
+			return;
+
+		if ((size_t)width*height != this->pixelCount)
+		{
+			this->pixelCount = (size_t)width*height;
+			this->pixelCounts.reset(new atomic<uint32_t>[this->pixelCount]);
+		}
+
+		atomic<uint32_t>* pixels = this->pixelCounts.get();
+		parallelFor(height, [&](int chunk, int start, int stop)
+		{
+			for (size_t p=(size_t)start*width;p<(size_t)stop*width;p++)
+				pixels[p].store(0, memory_order_relaxed);
+		});
+
+		int n = nbodyList.size();
+		int chunkCount = getParallelChunkCount(n);
+		this->circlePoints.resize(chunkCount);
+		this->circleSizes.resize(chunkCount);
+		this->velocityLines.resize(chunkCount);
+
+		parallelFor(n, [&](int chunk, int start, int stop)
+		{
+			vector<SDL_Point>& circles = this->circlePoints[chunk];
+			vector<int>& sizes = this->circleSizes[chunk];
+			vector<SDL_Point>& lines = this->velocityLines[chunk];
+			circles.clear();
+			sizes.clear();
+			lines.clear();
+
+			for (int i=start;i<stop;i++)
+			{
+				const nbody& curBody = nbodyList[i];
+				if (curBody.dead)
+					continue;
+
+				double x, y, radius;
+				view.project(curBody, &x, &y, &radius);
+
+				if (radius < this->pointRadius)
+				{
+					if (x >= 0 && y >= 0 && x < width && y < height)
+						pixels[(size_t)y*width + (int)x].fetch_add(1, memory_order_relaxed);
+					continue;
+				}
+
+				//Culled against the box holding the outline and the velocity line
+				double velX = view.rootScale ? 0 : curBody.velX;
+				double velY = view.rootScale ? 0 : curBody.velY;
+				if (x + max(radius, velX) < 0 || x + min(-radius, velX) >= width || y + max(radius, velY) < 0 || y + min(-radius, velY) >= height)
+					continue;
+
+				//Two pixels of outline per segment is plenty for small circles
+				int segments = max(6, min(this->maxCircleSegments, (int)(radius*2)));
+				appendCirclePoints(&circles, x, y, segments, radius);
+				sizes.push_back(segments + 1);
+
+				if (!view.rootScale)
+				{
+					SDL_Point lineStart, lineEnd;
+					lineStart.x = x;
+					lineStart.y = y;
+					lineEnd.x = x + velX;
+					lineEnd.y = y + velY;
+					lines.push_back(lineStart);
+					lines.push_back(lineEnd);
+				}
+			}
+		});
+
+		int rowChunks = getParallelChunkCount(height);
+		for (int s=0;s<shadeCount;s++)
+			this->pixelPoints[s].resize(rowChunks);
+
+		parallelFor(height, [&](int chunk, int start, int stop)
+		{
+			for (int s=0;s<shadeCount;s++)
+				this->pixelPoints[s][chunk].clear();
+
+			for (int row=start;row<stop;row++)
+			{
+				for (int column=0;column<width;column++)
+				{
+					uint32_t bodies = pixels[(size_t)row*width + column].load(memory_order_relaxed);
+					if (bodies == 0)
+						continue;
+
+					SDL_Point point;
+					point.x = column;
+					point.y = row;
+					this->pixelPoints[getShade(bodies)][chunk].push_back(point);
+				}
+			}
+		});
+
+		//SDL calls stay on this thread
+		Uint8 shades[shadeCount] = {0x90, 0xB8, 0xDC, 0xFF};
+		for (int s=0;s<shadeCount;s++)
+		{
+			SDL_SetRenderDrawColor(ren, shades[s], shades[s], shades[s], 0xFF);
+			for (int c=0;c<rowChunks;c++)
+				if (this->pixelPoints[s][c].size() > 0)
+					SDL_RenderDrawPoints(ren, this->pixelPoints[s][c].data(), this->pixelPoints[s][c].size());
+		}
+
+		SDL_SetRenderDrawColor(ren, 0xFF, 0x00, 0x00, 0xFF);
+		for (int c=0;c<chunkCount;c++)
+			for (int l=0;l+1<this->velocityLines[c].size();l+=2)
+				SDL_RenderDrawLine(ren, this->velocityLines[c][l].x, this->velocityLines[c][l].y, this->velocityLines[c][l+1].x, this->velocityLines[c][l+1].y);
+
+		SDL_SetRenderDrawColor(ren, 0xFF, 0xFF, 0xFF, 0xFF);
+		for (int c=0;c<chunkCount;c++)
+		{
+			int offset = 0;
+			for (int k=0;k<this->circleSizes[c].size();k++)
+			{
+				SDL_RenderDrawLines(ren, this->circlePoints[c].data() + offset, this->circleSizes[c][k]);
+				offset += this->circleSizes[c][k];
+			}
+		}
+	}
+};
+
+//Draws the bodies as a glowing density map instead of outlines, for views of millions of bodies
+//Bodies are projected in parallel, then each thread splats them into its own band of rows of a single float buffer, which
+//is tone mapped on a log scale against the densest pixel and streamed into a texture that is drawn with a single copy
+class DensityRenderer
+{
+public:
+	//Bodies are spread over at most this many pixels either side of their center, beyond that they are just bright
+	int maxSplatRadius = 32;
+
+	SDL_Texture* texture = NULL;
+	int textureWidth = 0;
+	int textureHeight = 0;
+	//Mass in each pixel of the last view, rows top to bottom
+	vector<float> density;
+	//Used when the texture can't be locked
+	vector<Uint32> staging;
+
+	~DensityRenderer()
+	{
+		if (this->texture != NULL)
+			SDL_DestroyTexture(this->texture);
+	}
+
+	//Adds mass spread over the pixels covered by a body at (x, y) of the given screen radius, only within rows top to bottom - 1
+	static void splat(float* buffer, int width, int top, int bottom, double x, double y, double radius, float mass, int maxRadius)
+	{
+		if (radius < 1)
+		{
+			//Shared between the four nearest pixel centers so slow moving bodies glide rather than jump a pixel at a time
+			double fx = x - .5;
+			double fy = y - .5;
+			int left = (int)floor(fx);
+			int up = (int)floor(fy);
+			if (up + 1 < top || up >= bottom)
+				return;
+			float tx = fx - left;
+			float ty = fy - up;
+			float weights[4] = {(1-tx)*(1-ty), tx*(1-ty), (1-tx)*ty, tx*ty};
+			for (int k=0;k<4;k++)
+			{
+				int px = left + (k & 1);
+				int py = up + (k >> 1);
+				if (px >= 0 && py >= top && px < width && py < bottom)
+					buffer[(size_t)py*width + px] += mass*weights[k];
+			}
+			return;
+		}
+
+		int r = min((int)radius, maxRadius);
+		int cx = (int)x;
+		int cy = (int)y;
+		float share = mass/((2*r + 1)*(2*r + 1));
+		for (int py=max(cy - r, top);py<=min(cy + r, bottom - 1);py++)
+			for (int px=max(cx - r, 0);px<=min(cx + r, width - 1);px++)
+				buffer[(size_t)py*width + px] += share;
+	}
+
+	//Splats the bodies into a density per pixel of view and returns it, with the scale getLevel needs to tone map it
+	const float* accumulate(const vector<nbody>& nbodyList, const ViewTransform& view, float* scale)
+	{
+		int width = view.width;
+		int height = view.height;
+		this->density.resize((size_t)width*height);
+		int n = nbodyList.size();
+		int chunkCount = getParallelChunkCount(n);
+		this->splats.resize(chunkCount);
+
+		parallelFor(n, [&](int chunk, int start, int stop)
+		{
+			vector<Splat>& chunkSplats = this->splats[chunk];
+			chunkSplats.clear();
+			for (int i=start;i<stop;i++)
+			{
+				const nbody& curBody = nbodyList[i];
+				if (curBody.dead)
+					continue;
+
+				Splat body;
+				view.project(curBody, &body.x, &body.y, &body.radius);
+				if (body.x + body.radius < -1 || body.y + body.radius < -1 || body.x - body.radius > width + 1 || body.y - body.radius > height + 1)
+					continue;
+				body.mass = curBody.mass;
+				chunkSplats.push_back(body);
+			}
+		});
+
+		//Each band is cleared and filled by one thread in body order, so the sums come out the same whatever the thread count
+		//Every band also finds its densest pixel
+		float* buffer = this->density.data();
+		vector<float> peaks(getParallelChunkCount(height), 0);
+		parallelFor(height, [&](int chunk, int top, int bottom)
+		{
+			fill(buffer + (size_t)top*width, buffer + (size_t)bottom*width, 0.0f);
+			for (int c=0;c<chunkCount;c++)
+				for (int k=0;k<this->splats[c].size();k++)
+				{
+					const Splat& body = this->splats[c][k];
+					splat(buffer, width, top, bottom, body.x, body.y, body.radius, body.mass, this->maxSplatRadius);
+				}
+
+			float peak = 0;
+			for (size_t p=(size_t)top*width;p<(size_t)bottom*width;p++)
+				peak = max(peak, buffer[p]);
+			peaks[chunk] = peak;
+		});
+
+		float peak = 0;
+		for (int c=0;c<peaks.size();c++)
+			peak = max(peak, peaks[c]);
+		*scale = peak > 0 ? 1/log(1 + peak) : 0;
+		return buffer;
+	}
+
+	//Brightness from 0 to 255 of a pixel of the given density, on a log scale where a lone unit mass still shows up and the densest pixel is white
+	static uint8_t getLevel(float density, float scale)
+	{
+		float level = log(1 + density)*scale;
+		return (uint8_t)(min(level, 1.0f)*255);
+	}
+
+	void draw(SDL_Renderer* ren, const vector<nbody>& nbodyList, const ViewTransform& view)
+	{
+		int width = view.width;
+		int height = view.height;
+		if (width <= 0 || height <= 0)
+			return;
+
+		if (this->texture == NULL || width != this->textureWidth || height != this->textureHeight)
+		{
+			if (this->texture != NULL)
+				SDL_DestroyTexture(this->texture);
+			this->texture = SDL_CreateTexture(ren, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING, width, height);
+			this->textureWidth = width;
+			this->textureHeight = height;
+			if (this->texture == NULL)
+			{
+				std::cout << "Couldn't create density texture: " << SDL_GetError() << "\n";
+				return;
+			}
+		}
+
+		size_t pixelCount = (size_t)width*height;
+		float scale = 0;
+		const float* total = this->accumulate(nbodyList, view, &scale);
+
+		//Straight into the texture's memory if it can be locked, otherwise through a copy
+		void* pixels = NULL;
+		int pitch = 0;
+		bool locked = SDL_LockTexture(this->texture, NULL, &pixels, &pitch) == 0;
+		if (!locked)
+		{
+			this->staging.resize(pixelCount);
+			pixels = this->staging.data();
+			pitch = width*sizeof(Uint32);
+		}
+
+		parallelFor(height, [&](int chunk, int start, int stop)
+		{
+			for (int row=start;row<stop;row++)
+			{
+				Uint32* out = (Uint32*)((Uint8*)pixels + (size_t)row*pitch);
+				for (int column=0;column<width;column++)
+				{
+					Uint32 value = getLevel(total[(size_t)row*width + column], scale);
+					out[column] = 0xFF000000 | value << 16 | value << 8 | value;
+				}
+			}
+		});
+
+		if (locked)
+			SDL_UnlockTexture(this->texture);
+		else
+			SDL_UpdateTexture(this->texture, NULL, pixels, pitch);
+
+		SDL_RenderCopy(ren, this->texture, NULL, NULL);
+	}
+
+private:
+	//A body in view, in screen coordinates
+	struct Splat
+	{
+		double x;
+		double y;
+		double radius;
+		float mass;
+	};
+
+	//Filled per chunk of bodies so threads never share a vector
+	vector<vector<Splat>> splats;
+};
+
+#endif
@@ -0,0 +1,213 @@
+#ifndef REWIND_H
+#define REWIND_H
+
+#include <vector>
+#include <deque>
+#include <stdint.h>
+#include "nbody.h"
+#include "compress.h"
+
+using namespace std;
+
+//Everything a body needs to carry on simulating: x, y, velX, velY, radius, mass and the static flag
+const int snapshotColumns = 7;
+
+//Recent states kept in memory, compressed without loss, so the simulation can be rewound to any of them and run on from there
+//Each snapshot is coded against the one before it, with a keyframe every keyframeEvery snapshots so restoring one only decodes
+//back to its keyframe. When the ring is over its memory budget the oldest keyframe and the snapshots coded against it go first
+class SnapshotRing
+{
+public:
+	struct Entry
+	{
+		uint64_t step;
+		int count;
+		bool keyframe;
+		vector<char> payload;
+	};
+
+	deque<Entry> entries;
+	size_t memoryBudget = 256 << 20;
+	size_t memoryUsed = 0;
+	int keyframeEvery = 16;
+
+	SnapshotRing()
+	{
+		this->encoder = FrameCodec(COMPRESSION_XOR, 0, snapshotColumns);
+		this->decoder = FrameCodec(COMPRESSION_XOR, 0, snapshotColumns);
+	}
+
+	void clear()
+	{
+		this->entries.clear();
+		this->memoryUsed = 0;
+		this->restart = true;
+		this->decodedEntry = -1;
+	}
+
+	int size()
+	{
+		return this->entries.size();
+	}
+
+	uint64_t getStep(int index)
+	{
+		return this->entries[index].step;
+	}
+
+	//Adds the live bodies of list as the state after step steps
+	void record(const vector<nbody>& list, uint64_t step)
+	{
+		int n = list.size();
+		int chunkCount = getParallelChunkCount(n);
+		vector<int> firstLive(chunkCount + 1, 0);
+		parallelFor(n, [&](int c, int start, int stop)
+		{
+			int live = 0;
+			for (int i=start;i<stop;i++)
+				live += !list[i].dead;
+			firstLive[c + 1] = live;
+		});
+		for (int c=0;c<chunkCount;c++)
+			firstLive[c + 1] += firstLive[c];
+		int count = firstLive[chunkCount];
+
+		this->resizeScratch(count);
+		parallelFor(n, [&](int c, int start, int stop)
+		{
+			int out = firstLive[c];
+			for (int i=start;i<stop;i++)
+			{
+				const nbody& curBody = list[i];
+				if (curBody.dead)
+					continue;
+				this->ids[out] = curBody.id;
+				this->columns[0][out] = curBody.x;
+				this->columns[1][out] = curBody.y;
+				this->columns[2][out] = curBody.velX;
+				this->columns[3][out] = curBody.velY;
+				this->columns[4][out] = curBody.radius;
+				this->columns[5][out] = curBody.mass;
+				this->columns[6][out] = curBody.staticBody;
+				out++;
+			}
+		});
+
+		int sinceKeyframe = 0;
+		for (int e=this->entries.size()-1;e>=0 && !this->entries[e].keyframe;e--)
+			sinceKeyframe++;
+
+		Entry entry;
+		entry.step = step;
+		entry.count = count;
+		entry.keyframe = this->restart || sinceKeyframe + 1 >= this->keyframeEvery;
+		this->restart = false;
+		const double* columnData[snapshotColumns];
+		for (int c=0;c<snapshotColumns;c++)
+			columnData[c] = this->columns[c].data();
+		this->encoder.encode(this->ids.data(), columnData, count, entry.keyframe, &entry.payload);
+		entry.payload.shrink_to_fit();
+		this->memoryUsed += entry.payload.capacity();
+		this->entries.push_back(move(entry));
+		this->evict();
+	}
+
+	//Replaces list with snapshot index, decoding forward from where the last restore left off when it can
+	bool restore(int index, vector<nbody>* list)
+	{
+		if (index < 0 || index >= this->entries.size())
+			return false;
+
+		int first = index;
+		while (first > 0 && !this->entries[first].keyframe)
+			first--;
+		if (this->decodedEntry >= first && this->decodedEntry < index)
+			first = this->decodedEntry + 1;
+
+		double* columnData[snapshotColumns];
+		for (int e=first;e<=index;e++)
+		{
+			const Entry& entry = this->entries[e];
+			this->resizeScratch(entry.count);
+			for (int c=0;c<snapshotColumns;c++)
+				columnData[c] = this->columns[c].data();
+			if (!this->decoder.decode(entry.payload.data(), entry.payload.size(), entry.count, entry.keyframe, this->ids.data(), columnData))
+			{
+				this->decodedEntry = -1;
+				return false;
+			}
+			this->decodedEntry = e;
+		}
+
+		int count = this->entries[index].count;
+		list->resize(count);
+		parallelFor(count, [&](int c, int start, int stop)
+		{
+			for (int i=start;i<stop;i++)
+			{
+				nbody& curBody = (*list)[i];
+				curBody = getNewNBody(columnData[0][i], columnData[1][i], columnData[2][i], columnData[3][i], 1, columnData[6][i] != 0);
+				curBody.radius = columnData[4][i];
+				curBody.mass = columnData[5][i];
+				curBody.id = this->ids[i];
+			}
+		});
+		return true;
+	}
+
+	//Drops every snapshot after index, for carrying on from it. The next one recorded starts a new keyframe
+	void truncate(int index)
+	{
+		while (this->entries.size() > index + 1)
+		{
+			this->memoryUsed -= this->entries.back().payload.capacity();
+			this->entries.pop_back();
+		}
+		this->restart = true;
+		this->decodedEntry = -1;
+	}
+
+private:
+	FrameCodec encoder;
+	FrameCodec decoder;
+	//Set when the encoder's history no longer matches the newest entry
+	bool restart = true;
+	//The decoder's history is that of this entry, -1 if it has none
+	int decodedEntry = -1;
+	vector<uint32_t> ids;
+	vector<double> columns[snapshotColumns];
+
+	void resizeScratch(int count)
+	{
+		this->ids.resize(count);
+		for (int c=0;c<snapshotColumns;c++)
+			this->columns[c].resize(count);
+	}
+
+	void evict()
+	{
+		while (this->memoryUsed > this->memoryBudget && this->entries.size() > 1)
+		{
+			//The snapshots after a keyframe can't be decoded without it, so they go together
+			int groupSize = 1;
+			while (groupSize < this->entries.size() && !this->entries[groupSize].keyframe)
+				groupSize++;
+
+			//Still recording into the only group left, the next snapshot starts a new one so this one can go later
+			if (groupSize == this->entries.size())
+			{
+				this->restart = true;
+				return;
+			}
+
+			for (int e=0;e<groupSize;e++)
+			{
+				this->memoryUsed -= this->entries.front().payload.capacity();
+				this->entries.pop_front();
+			}
+			this->decodedEntry = this->decodedEntry >= groupSize ? this->decodedEntry - groupSize : -1;
+		}
+	}
+};
+
+#endif
@@ -0,0 +1,954 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <iostream>
+#include <vector>
+#include <deque>
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "nbody.h"
+#ifdef _WIN32
+#include "windows.h"
+#include <io.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#endif
+//io_uring is used through its system calls so it needs no library, only headers new enough to have it
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define NBODY_IO_URING
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#endif
+#endif
+
+using namespace std;
+
+class UringWriter;
+
+//Bodies are written in blocks of this many, each with its bounding box in the index at the end of the file
+const int snapshotBlockSize = 4096;
+
+//Position of (x, y) along a Hilbert curve through a 2^32 by 2^32 grid. Points close on the curve are close in space,
+//so a run of bodies sorted by it covers a small area
+uint64_t getHilbertKey(uint32_t x, uint32_t y)
+{
+	uint64_t key = 0;
+	for (uint32_t s=1u << 31;s>0;s>>=1)
+	{
+		uint32_t rx = (x & s) != 0;
+		uint32_t ry = (y & s) != 0;
+		key += (uint64_t)s*s*((3*rx) ^ ry);
+		//Turn the quadrant so the curve inside it starts and ends where the bigger one expects
+		if (ry == 0)
+		{
+			if (rx == 1)
+			{
+				x = ~x;
+				y = ~y;
+			}
+			swap(x, y);
+		}
+	}
+	return key;
+}
+
+//Same text format loadNBodyList reads: a "#seeds" comment line, then x,y,velX,velY,radius,mass for each live body
+//The bodies go in Hilbert curve order over their bounding box, followed by a comment line for each block of them:
+//"#block minX minY maxX maxY offset count" with the box around the bodies including their radius and the byte offset
+//of the block's first line, and last of all "#index offset blockCount" pointing at the first of those lines.
+//Readers that don't know the index skip it like any other comment
+void formatNBodyList(const vector<nbody>& list, const vector<uint64_t>& seeds, string* out)
+{
+	out->clear();
+	char line[160];
+	if (seeds.size() > 0)
+	{
+		out->append("#seeds");
+		for (int i=0;i<seeds.size();i++)
+		{
+			snprintf(line, sizeof(line), " %llu", (unsigned long long)seeds[i]);
+			out->append(line);
+		}
+		out->append("\n");
+	}
+
+	double minX = INFINITY, minY = INFINITY, maxX = -INFINITY, maxY = -INFINITY;
+	vector<pair<uint64_t, int>> order;
+	for (int i=0;i<list.size();i++)
+	{
+		if (list[i].dead)
+			continue;
+		minX = min(minX, list[i].x);
+		minY = min(minY, list[i].y);
+		maxX = max(maxX, list[i].x);
+		maxY = max(maxY, list[i].y);
+		order.push_back(make_pair(0, i));
+	}
+	double gridX = maxX > minX ? 4294967295.0/(maxX - minX) : 0;
+	double gridY = maxY > minY ? 4294967295.0/(maxY - minY) : 0;
+	parallelFor(order.size(), [&](int chunk, int start, int stop)
+	{
+		for (int i=start;i<stop;i++)
+		{
+			const nbody& curBody = list[order[i].second];
+			order[i].first = getHilbertKey((uint32_t)min((curBody.x - minX)*gridX, 4294967295.0), (uint32_t)min((curBody.y - minY)*gridY, 4294967295.0));
+		}
+	});
+	sort(order.begin(), order.end());
+
+	string index;
+	int blockCount = 0;
+	for (int first=0;first<order.size();first+=snapshotBlockSize)
+	{
+		int last = min((int)order.size(), first + snapshotBlockSize);
+		size_t offset = out->size();
+		double blockMinX = INFINITY, blockMinY = INFINITY, blockMaxX = -INFINITY, blockMaxY = -INFINITY;
+		for (int i=first;i<last;i++)
+		{
+			const nbody& curBody = list[order[i].second];
+			int length = snprintf(line, sizeof(line), "%.17g,%.17g,%.17g,%.17g,%.17g,%d\n", curBody.x, curBody.y, curBody.velX, curBody.velY, curBody.radius, (int)curBody.mass);
+			out->append(line, length);
+			blockMinX = min(blockMinX, curBody.x - curBody.radius);
+			blockMinY = min(blockMinY, curBody.y - curBody.radius);
+			blockMaxX = max(blockMaxX, curBody.x + curBody.radius);
+			blockMaxY = max(blockMaxY, curBody.y + curBody.radius);
+		}
+		snprintf(line, sizeof(line), "#block %.17g %.17g %.17g %.17g %llu %d\n", blockMinX, blockMinY, blockMaxX, blockMaxY, (unsigned long long)offset, last - first);
+		index.append(line);
+		blockCount++;
+	}
+	snprintf(line, sizeof(line), "#index %llu %d\n", (unsigned long long)out->size(), blockCount);
+	out->append(index);
+	out->append(line);
+}
+
+#ifdef NBODY_IO_URING
+//A small io_uring that writes one buffer to a file as several block writes in flight at once
+//Doesn't set up on kernels older than 5.6 or where it's blocked, and writeFileAtomically writes the usual way then or if a ring write fails
+class UringWriter
+{
+public:
+	static const unsigned entries = 8;
+	static const size_t blockSize = 4 << 20;
+	int ringFd = -1;
+	void* sqRing = MAP_FAILED;
+	size_t sqRingSize = 0;
+	io_uring_sqe* sqes = (io_uring_sqe*)MAP_FAILED;
+	unsigned* sqTail;
+	unsigned* sqMask;
+	unsigned* sqArray;
+	unsigned* cqHead;
+	unsigned* cqTail;
+	unsigned* cqMask;
+	io_uring_cqe* cqes;
+
+	UringWriter()
+	{
+		io_uring_params params;
+		memset(&params, 0, sizeof(params));
+		this->ringFd = syscall(__NR_io_uring_setup, entries, &params);
+		//IORING_OP_WRITE came in 5.6 with IORING_FEAT_RW_CUR_POS, a 5.4 or 5.5 ring would set up and then fail every write
+		if (this->ringFd < 0 || !(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_RW_CUR_POS))
+		{
+			this->release();
+			return;
+		}
+
+		//With IORING_FEAT_SINGLE_MMAP (5.4 and up) both rings share one mapping
+		this->sqRingSize = max(params.sq_off.array + params.sq_entries*sizeof(unsigned), params.cq_off.cqes + params.cq_entries*sizeof(io_uring_cqe));
+		this->sqRing = mmap(NULL, this->sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, this->ringFd, IORING_OFF_SQ_RING);
+		this->sqes = (io_uring_sqe*)mmap(NULL, params.sq_entries*sizeof(io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, this->ringFd, IORING_OFF_SQES);
+		if (this->sqRing == MAP_FAILED || this->sqes == MAP_FAILED)
+		{
+			this->release();
+			return;
+		}
+
+		char* sq = (char*)this->sqRing;
+		this->sqTail = (unsigned*)(sq + params.sq_off.tail);
+		this->sqMask = (unsigned*)(sq + params.sq_off.ring_mask);
+		this->sqArray = (unsigned*)(sq + params.sq_off.array);
+		this->cqHead = (unsigned*)(sq + params.cq_off.head);
+		this->cqTail = (unsigned*)(sq + params.cq_off.tail);
+		this->cqMask = (unsigned*)(sq + params.cq_off.ring_mask);
+		this->cqes = (io_uring_cqe*)(sq + params.cq_off.cqes);
+		this->sqeCount = params.sq_entries;
+	}
+
+	~UringWriter()
+	{
+		this->release();
+	}
+
+	bool isAvailable()
+	{
+		return this->ringFd >= 0;
+	}
+
+	//Writes bytes of data to fd from offset 0, returns false if any of it couldn't be written
+	//Even then it only returns once the kernel is done with every write it took, so data and fd are free to use again
+	bool writeAll(int fd, const char* data, size_t bytes)
+	{
+		size_t queued = 0;
+		//Writes the kernel has taken and not finished yet
+		unsigned inFlight = 0;
+		bool ok = true;
+		while (inFlight > 0 || (ok && queued < bytes))
+		{
+			unsigned submitting = 0;
+			unsigned tail = *this->sqTail;
+			while (ok && queued < bytes && inFlight + submitting < this->sqeCount)
+			{
+				unsigned slot = tail & *this->sqMask;
+				io_uring_sqe* sqe = &this->sqes[slot];
+				size_t length = min((size_t)blockSize, bytes - queued);
+				memset(sqe, 0, sizeof(*sqe));
+				sqe->opcode = IORING_OP_WRITE;
+				sqe->fd = fd;
+				sqe->addr = (uint64_t)(uintptr_t)(data + queued);
+				sqe->len = length;
+				sqe->off = queued;
+				sqe->user_data = queued;
+				this->sqArray[slot] = slot;
+				tail++;
+				submitting++;
+				queued += length;
+			}
+			__atomic_store_n(this->sqTail, tail, __ATOMIC_RELEASE);
+
+			//Only waits when the kernel already has writes, waiting on ones it might turn down could never end
+			//Retrying after an interrupt can't submit anything twice, the kernel only takes entries past the ones it has
+			long entered;
+			do
+				entered = syscall(__NR_io_uring_enter, this->ringFd, submitting, inFlight > 0 ? 1 : 0, IORING_ENTER_GETEVENTS, NULL, 0);
+			while (entered < 0 && errno == EINTR);
+			if (entered < (long)submitting)
+			{
+				//Entries the kernel didn't take come back out of the ring so no later call submits them, and nothing more is queued
+				ok = false;
+				entered = max(entered, 0L);
+				__atomic_store_n(this->sqTail, tail - (submitting - (unsigned)entered), __ATOMIC_RELEASE);
+			}
+			inFlight += entered;
+
+			unsigned head = *this->cqHead;
+			while (head != __atomic_load_n(this->cqTail, __ATOMIC_ACQUIRE))
+			{
+				io_uring_cqe* cqe = &this->cqes[head & *this->cqMask];
+				size_t offset = cqe->user_data;
+				size_t length = min((size_t)blockSize, bytes - offset);
+				//A short write finishes with a plain one rather than being queued again
+				if (cqe->res < 0)
+					ok = false;
+				else if ((size_t)cqe->res < length)
+					ok = ok && pwrite(fd, data + offset + cqe->res, length - cqe->res, offset + cqe->res) == (ssize_t)(length - cqe->res);
+				head++;
+				inFlight--;
+			}
+			__atomic_store_n(this->cqHead, head, __ATOMIC_RELEASE);
+		}
+		return ok;
+	}
+
+private:
+	unsigned sqeCount = 0;
+
+	void release()
+	{
+		if (this->sqes != MAP_FAILED)
+			munmap(this->sqes, this->sqeCount*sizeof(io_uring_sqe));
+		if (this->sqRing != MAP_FAILED)
+			munmap(this->sqRing, this->sqRingSize);
+		if (this->ringFd >= 0)
+			close(this->ringFd);
+		this->sqes = (io_uring_sqe*)MAP_FAILED;
+		this->sqRing = MAP_FAILED;
+		this->ringFd = -1;
+	}
+};
+#endif
+
+//A whole file mapped read only, or read into memory where it can't be mapped
+class MappedFile
+{
+public:
+	const char* data = NULL;
+	size_t size = 0;
+
+	~MappedFile()
+	{
+		this->close();
+	}
+
+	bool open(const string& path)
+	{
+		this->close();
+#ifdef _WIN32
+		this->file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+		if (this->file == INVALID_HANDLE_VALUE)
+			return false;
+		LARGE_INTEGER fileSize;
+		GetFileSizeEx(this->file, &fileSize);
+		this->size = fileSize.QuadPart;
+		if (this->size == 0)
+			return true;
+		this->mapping = CreateFileMappingA(this->file, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (this->mapping != NULL)
+			this->view = MapViewOfFile(this->mapping, FILE_MAP_READ, 0, 0, 0);
+		if (this->view != NULL)
+		{
+			this->data = (const char*)this->view;
+			return true;
+		}
+#else
+		this->fd = ::open(path.c_str(), O_RDONLY);
+		if (this->fd < 0)
+			return false;
+		struct stat info;
+		if (fstat(this->fd, &info) != 0)
+			return false;
+		this->size = info.st_size;
+		if (this->size == 0)
+			return true;
+		this->view = mmap(NULL, this->size, PROT_READ, MAP_PRIVATE, this->fd, 0);
+		if (this->view != MAP_FAILED)
+		{
+			madvise(this->view, this->size, MADV_SEQUENTIAL);
+			this->data = (const char*)this->view;
+			return true;
+		}
+		this->view = NULL;
+#endif
+		FILE* f = fopen(path.c_str(), "rb");
+		if (f == NULL)
+			return false;
+		this->copy.resize(this->size);
+		this->size = fread(this->copy.data(), 1, this->size, f);
+		fclose(f);
+		this->data = this->copy.data();
+		return true;
+	}
+
+	void close()
+	{
+#ifdef _WIN32
+		if (this->view != NULL)
+			UnmapViewOfFile(this->view);
+		if (this->mapping != NULL)
+			CloseHandle(this->mapping);
+		if (this->file != INVALID_HANDLE_VALUE)
+			CloseHandle(this->file);
+		this->mapping = NULL;
+		this->file = INVALID_HANDLE_VALUE;
+#else
+		if (this->view != NULL)
+			munmap(this->view, this->size);
+		if (this->fd >= 0)
+			::close(this->fd);
+		this->fd = -1;
+#endif
+		this->view = NULL;
+		this->data = NULL;
+		this->size = 0;
+		this->copy.clear();
+	}
+
+private:
+	void* view = NULL;
+	vector<char> copy;
+#ifdef _WIN32
+	HANDLE file = INVALID_HANDLE_VALUE;
+	HANDLE mapping = NULL;
+#else
+	int fd = -1;
+#endif
+};
+
+struct CsvError
+{
+	//Counted from 1 like an editor does
+	int line;
+	string message;
+};
+
+//strtod with a fast path for numbers of at most 15 significant digits and small exponents, which is what most
+//hand made and exported files hold. Those are exact as a double times or divided by an exact power of ten, the rest go to strtod
+double parseDouble(const char* text, char** stop)
+{
+	static const double powers[] = {1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+	const char* at = text;
+	while (*at == ' ' || *at == '\t')
+		at++;
+	bool negative = *at == '-';
+	if (*at == '-' || *at == '+')
+		at++;
+
+	uint64_t mantissa = 0;
+	int digits = 0;
+	int exponent = 0;
+	const char* first = at;
+	while (*at >= '0' && *at <= '9')
+	{
+		if (mantissa > 0 || *at != '0')
+			digits++;
+		mantissa = mantissa*10 + (*at++ - '0');
+		if (digits > 15)
+			return strtod(text, stop);
+	}
+	if (*at == '.')
+	{
+		at++;
+		while (*at >= '0' && *at <= '9')
+		{
+			if (mantissa > 0 || *at != '0')
+				digits++;
+			mantissa = mantissa*10 + (*at++ - '0');
+			exponent--;
+			if (digits > 15)
+				return strtod(text, stop);
+		}
+	}
+	if (at == first || (at == first + 1 && *first == '.'))
+		return strtod(text, stop);
+	if (*at == 'e' || *at == 'E')
+	{
+		const char* exponentStart = at++;
+		bool negativeExponent = *at == '-';
+		if (*at == '-' || *at == '+')
+			at++;
+		if (*at < '0' || *at > '9')
+			at = exponentStart;
+		else
+		{
+			int written = 0;
+			while (*at >= '0' && *at <= '9' && written < 1000)
+				written = written*10 + (*at++ - '0');
+			exponent += negativeExponent ? -written : written;
+		}
+	}
+	if (exponent < -22 || exponent > 22)
+		return strtod(text, stop);
+
+	double value = exponent < 0 ? (double)mantissa/powers[-exponent] : (double)mantissa*powers[exponent];
+	*stop = (char*)at;
+	return negative ? -value : value;
+}
+
+//Parses one x,y,velX,velY,radius,mass line, text has to be null terminated
+bool parseBodyLine(const char* text, nbody* result, string* error)
+{
+	double values[6];
+	const char* at = text;
+	for (int v=0;v<6;v++)
+	{
+		char* stop;
+		values[v] = parseDouble(at, &stop);
+		if (stop == at)
+		{
+			*error = "field " + to_string(v + 1) + " isn't a number";
+			return false;
+		}
+		if (!isfinite(values[v]))
+		{
+			*error = "field " + to_string(v + 1) + " isn't finite";
+			return false;
+		}
+		at = stop;
+		while (*at == ' ' || *at == '\t')
+			at++;
+		if (v < 5)
+		{
+			if (*at != ',')
+			{
+				*error = "expected 6 comma separated fields, found " + to_string(v + 1);
+				return false;
+			}
+			at++;
+		}
+	}
+	if (*at != 0)
+	{
+		*error = "more than 6 fields";
+		return false;
+	}
+	if (values[4] <= 0 || values[5] < 1 || values[5] > 2147483647.0)
+	{
+		*error = "radius has to be above 0 and mass a whole number of at least 1";
+		return false;
+	}
+
+	*result = getNewNBody(values[0], values[1], values[2], values[3], 1, false);
+	result->radius = values[4];
+	result->mass = (int)values[5];
+	return true;
+}
+
+//Parses the lines from at to end into out, the first of them being line number line, and returns where the bodies it read end
+//Any "#seeds" line goes into seeds, other comments are skipped and lines that don't parse are reported in errors
+nbody* parseCsvRun(const char* at, const char* end, int line, nbody* out, vector<CsvError>* errors, vector<uint64_t>* seeds)
+{
+	char text[256];
+	string error;
+	while (at < end)
+	{
+		const char* newline = (const char*)memchr(at, '\n', end - at);
+		const char* lineEnd = newline != NULL ? newline : end;
+		const char* next = lineEnd + 1;
+		if (lineEnd > at && lineEnd[-1] == '\r')
+			lineEnd--;
+		size_t length = lineEnd - at;
+
+		if (length >= sizeof(text))
+			errors->push_back({line, "line is too long"});
+		else if (length > 0)
+		{
+			//Copied out so strtod stops at the end of the line, the mapping isn't null terminated
+			memcpy(text, at, length);
+			text[length] = 0;
+			if (strncmp(text, "#seeds", 6) == 0)
+			{
+				const char* seed = text + 6;
+				char* stop;
+				for (uint64_t value=strtoull(seed, &stop, 10); stop != seed; value=strtoull(seed, &stop, 10))
+				{
+					seeds->push_back(value);
+					seed = stop;
+				}
+			}
+			else if (text[0] != '#')
+			{
+				if (parseBodyLine(text, out, &error))
+					out++;
+				else
+					errors->push_back({line, error});
+			}
+		}
+		line++;
+		at = next;
+	}
+	return out;
+}
+
+//Counts the lines from at to end that hold a body rather than a comment
+int countCsvBodies(const char* at, const char* end)
+{
+	int bodies = 0;
+	while (at < end)
+	{
+		const char* newline = (const char*)memchr(at, '\n', end - at);
+		const char* lineEnd = newline != NULL ? newline : end;
+		if (lineEnd > at && *at != '#' && !(lineEnd - at == 1 && *at == '\r'))
+			bodies++;
+		at = lineEnd + 1;
+	}
+	return bodies;
+}
+
+//One block of bodies in a snapshot written by formatNBodyList
+struct SnapshotBlock
+{
+	double minX;
+	double minY;
+	double maxX;
+	double maxY;
+	size_t offset;
+	size_t bytes;
+	int count;
+	//Line number of its first body
+	int firstLine;
+};
+
+//Reads the block index from the end of a snapshot into blocks, false if it has none or it doesn't fit the file
+bool readSnapshotIndex(const char* data, size_t size, vector<SnapshotBlock>* blocks)
+{
+	blocks->clear();
+	if (size < 2 || data[size - 1] != '\n')
+		return false;
+	size_t lineStart = size - 1;
+	while (lineStart > 0 && data[lineStart - 1] != '\n')
+		lineStart--;
+	char text[160];
+	size_t length = size - 1 - lineStart;
+	if (length >= sizeof(text))
+		return false;
+	memcpy(text, data + lineStart, length);
+	text[length] = 0;
+	unsigned long long indexOffset;
+	int blockCount;
+	if (sscanf(text, "#index %llu %d", &indexOffset, &blockCount) != 2 || indexOffset > lineStart || blockCount < 0)
+		return false;
+
+	const char* at = data + indexOffset;
+	const char* end = data + lineStart;
+	int line = 0;
+	for (int b=0;b<blockCount;b++)
+	{
+		const char* newline = at < end ? (const char*)memchr(at, '\n', end - at) : NULL;
+		if (newline == NULL || newline - at >= sizeof(text))
+			return false;
+		memcpy(text, at, newline - at);
+		text[newline - at] = 0;
+		SnapshotBlock block;
+		unsigned long long offset;
+		if (sscanf(text, "#block %lf %lf %lf %lf %llu %d", &block.minX, &block.minY, &block.maxX, &block.maxY, &offset, &block.count) != 6)
+			return false;
+		//Blocks follow one another up to the index, each starting on a line of its own
+		if (offset > indexOffset || (offset > 0 && data[offset - 1] != '\n') || (b > 0 && offset < blocks->back().offset) || block.count < 0)
+			return false;
+		if (b == 0)
+		{
+			//Lines before the first block are the seeds line, after it each line is one body
+			line = 1;
+			for (const char* c=data;c<data + offset;c++)
+				line += *c == '\n';
+		}
+		block.offset = offset;
+		block.firstLine = line;
+		line += block.count;
+		blocks->push_back(block);
+		at = newline + 1;
+	}
+	//Each block runs up to the next one and the last up to the index
+	for (int b=0;b<blockCount;b++)
+	{
+		size_t next = b + 1 < blockCount ? (*blocks)[b + 1].offset : indexOffset;
+		(*blocks)[b].bytes = next - (*blocks)[b].offset;
+	}
+	return at == end;
+}
+
+//Reads a list written by formatNBodyList into list, replacing what it held, and the "#seeds" line into seeds
+//The file is mapped and cut into one run of whole lines per thread. Each run counts its bodies first so all of
+//them can be parsed straight into place in a list sized once. Lines that don't parse are skipped and reported in errors
+bool importNBodyCsv(const string& path, vector<nbody>* list, vector<uint64_t>* seeds, vector<CsvError>* errors)
+{
+	list->clear();
+	seeds->clear();
+	errors->clear();
+	MappedFile file;
+	if (!file.open(path))
+	{
+		std::cout << "Couldn't open " << path << "\n";
+		return false;
+	}
+
+	const char* data = file.data;
+	size_t size = file.size;
+	int chunkCount = max(1, min(getThreadCount(), (int)(size/65536) + 1));
+	vector<size_t> chunkStart(chunkCount + 1, size);
+	chunkStart[0] = 0;
+	for (int c=1;c<chunkCount;c++)
+	{
+		size_t at = max(chunkStart[c - 1], size*c/chunkCount);
+		const char* newline = at < size ? (const char*)memchr(data + at, '\n', size - at) : NULL;
+		chunkStart[c] = newline != NULL ? newline - data + 1 : size;
+	}
+
+	//Lines and bodies in each run, then where each run's first line and body fall overall
+	vector<int> firstLine(chunkCount + 1, 0);
+	vector<int> firstBody(chunkCount + 1, 0);
+	parallelFor(chunkCount, [&](int chunk, int start, int stop)
+	{
+		for (int c=start;c<stop;c++)
+		{
+			int lines = 0;
+			int bodies = 0;
+			const char* at = data + chunkStart[c];
+			const char* end = data + chunkStart[c + 1];
+			while (at < end)
+			{
+				const char* newline = (const char*)memchr(at, '\n', end - at);
+				const char* lineEnd = newline != NULL ? newline : end;
+				if (lineEnd > at && *at != '#' && !(lineEnd - at == 1 && *at == '\r'))
+					bodies++;
+				lines++;
+				at = lineEnd + 1;
+			}
+			firstLine[c + 1] = lines;
+			firstBody[c + 1] = bodies;
+		}
+	});
+	for (int c=0;c<chunkCount;c++)
+	{
+		firstLine[c + 1] += firstLine[c];
+		firstBody[c + 1] += firstBody[c];
+	}
+
+	list->resize(firstBody[chunkCount]);
+	vector<int> parsed(chunkCount, 0);
+	vector<vector<CsvError>> chunkErrors(chunkCount);
+	vector<vector<uint64_t>> chunkSeeds(chunkCount);
+	parallelFor(chunkCount, [&](int chunk, int start, int stop)
+	{
+		for (int c=start;c<stop;c++)
+		{
+			nbody* out = parseCsvRun(data + chunkStart[c], data + chunkStart[c + 1], firstLine[c] + 1, list->data() + firstBody[c], &chunkErrors[c], &chunkSeeds[c]);
+			parsed[c] = out - (list->data() + firstBody[c]);
+		}
+	});
+
+	//Bad lines leave gaps at the end of their run, later runs are moved down over them
+	int count = 0;
+	for (int c=0;c<chunkCount;c++)
+	{
+		if (count != firstBody[c] && parsed[c] > 0)
+			memmove(list->data() + count, list->data() + firstBody[c], sizeof(nbody)*parsed[c]);
+		count += parsed[c];
+		errors->insert(errors->end(), chunkErrors[c].begin(), chunkErrors[c].end());
+		seeds->insert(seeds->end(), chunkSeeds[c].begin(), chunkSeeds[c].end());
+	}
+	list->resize(count);
+	assignBodyIds(list->data(), count);
+	return true;
+}
+
+//Bodies in the whole of a snapshot by its index, -1 if it has none
+int getSnapshotBodyCount(const string& path)
+{
+	MappedFile file;
+	vector<SnapshotBlock> blocks;
+	if (!file.open(path) || !readSnapshotIndex(file.data, file.size, &blocks))
+		return -1;
+	int total = 0;
+	for (int b=0;b<blocks.size();b++)
+		total += blocks[b].count;
+	return total;
+}
+
+//Like importNBodyCsv but only reads the bodies that overlap the rectangle from minX, minY to maxX, maxY
+//Only the blocks whose boxes overlap it are read from the file, so a small region of a big snapshot loads in a fraction
+//of the time. Returns false without reading anything if the file has no index
+bool importNBodyRegion(const string& path, double minX, double minY, double maxX, double maxY, vector<nbody>* list, vector<uint64_t>* seeds, vector<CsvError>* errors)
+{
+	MappedFile file;
+	vector<SnapshotBlock> blocks;
+	if (!file.open(path) || !readSnapshotIndex(file.data, file.size, &blocks))
+		return false;
+	list->clear();
+	seeds->clear();
+	errors->clear();
+
+	//The header with the seeds line is read like a block that is always in the region
+	vector<SnapshotBlock> runs;
+	SnapshotBlock header = {0, 0, 0, 0, 0, blocks.size() > 0 ? blocks[0].offset : 0, 0, 1};
+	runs.push_back(header);
+	for (int b=0;b<blocks.size();b++)
+		if (blocks[b].maxX >= minX && blocks[b].minX <= maxX && blocks[b].maxY >= minY && blocks[b].minY <= maxY)
+			runs.push_back(blocks[b]);
+
+	const char* data = file.data;
+	int runCount = runs.size();
+	//The lines are counted rather than trusting the index, so a file edited since it was written can't overrun the list
+	vector<int> firstBody(runCount + 1, 0);
+	parallelFor(runCount, [&](int chunk, int start, int stop)
+	{
+		for (int r=start;r<stop;r++)
+			firstBody[r + 1] = countCsvBodies(data + runs[r].offset, data + runs[r].offset + runs[r].bytes);
+	});
+	for (int r=0;r<runCount;r++)
+		firstBody[r + 1] += firstBody[r];
+
+	list->resize(firstBody[runCount]);
+	vector<int> kept(runCount, 0);
+	vector<vector<CsvError>> runErrors(runCount);
+	vector<vector<uint64_t>> runSeeds(runCount);
+	parallelFor(runCount, [&](int chunk, int start, int stop)
+	{
+		for (int r=start;r<stop;r++)
+		{
+			nbody* first = list->data() + firstBody[r];
+			nbody* end = parseCsvRun(data + runs[r].offset, data + runs[r].offset + runs[r].bytes, runs[r].firstLine, first, &runErrors[r], &runSeeds[r]);
+			nbody* out = first;
+			for (nbody* body=first;body<end;body++)
+				if (body->x + body->radius >= minX && body->x - body->radius <= maxX && body->y + body->radius >= minY && body->y - body->radius <= maxY)
+					*out++ = *body;
+			kept[r] = out - first;
+		}
+	});
+
+	int count = 0;
+	for (int r=0;r<runCount;r++)
+	{
+		if (count != firstBody[r] && kept[r] > 0)
+			memmove(list->data() + count, list->data() + firstBody[r], sizeof(nbody)*kept[r]);
+		count += kept[r];
+		errors->insert(errors->end(), runErrors[r].begin(), runErrors[r].end());
+		seeds->insert(seeds->end(), runSeeds[r].begin(), runSeeds[r].end());
+	}
+	list->resize(count);
+	assignBodyIds(list->data(), count);
+	return true;
+}
+
+//Writes data to path + ".tmp", flushes it to disk and renames it over path, so path always holds a whole snapshot
+bool writeFileAtomically(const string& path, const char* data, size_t bytes, UringWriter* uring = NULL)
+{
+	string temporary = path + ".tmp";
+#ifdef _WIN32
+	FILE* file = fopen(temporary.c_str(), "wb");
+	if (file == NULL)
+		return false;
+	bool ok = fwrite(data, 1, bytes, file) == bytes && fflush(file) == 0 && _commit(_fileno(file)) == 0;
+	fclose(file);
+	return ok && MoveFileExA(temporary.c_str(), path.c_str(), MOVEFILE_REPLACE_EXISTING | MOVEFILE_WRITE_THROUGH);
+#else
+	int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return false;
+
+	bool ok = true;
+	bool ringWritten = false;
+#ifdef NBODY_IO_URING
+	//The ring writes at explicit offsets, so if it fails the plain writes below start over from the beginning of the file
+	if (uring != NULL && uring->isAvailable())
+		ringWritten = uring->writeAll(fd, data, bytes);
+	if (!ringWritten && lseek(fd, 0, SEEK_SET) != 0)
+		ok = false;
+#endif
+	if (!ringWritten)
+	{
+		size_t written = 0;
+		while (ok && written < bytes)
+		{
+			ssize_t result = write(fd, data + written, bytes - written);
+			if (result < 0 && errno == EINTR)
+				continue;
+			ok = result > 0;
+			written += result > 0 ? result : 0;
+		}
+	}
+
+	ok = ok && fsync(fd) == 0;
+	ok = close(fd) == 0 && ok;
+	return ok && rename(temporary.c_str(), path.c_str()) == 0;
+#endif
+}
+
+//Saves on its own thread so a save or checkpoint only costs the caller a copy of the bodies
+//A second save to a path that is still waiting its turn replaces the first, so a slow disk drops stale snapshots instead of queueing them
+class SnapshotWriter
+{
+public:
+	struct Request
+	{
+		string path;
+		vector<nbody> bodies;
+		vector<uint64_t> seeds;
+	};
+
+	SnapshotWriter()
+	{
+		this->worker = thread(&SnapshotWriter::run, this);
+	}
+
+	//Writes whatever is still queued before returning
+	~SnapshotWriter()
+	{
+		{
+			lock_guard<mutex> guard(this->lock);
+			this->stopping = true;
+		}
+		this->wake.notify_all();
+		this->worker.join();
+	}
+
+	void save(const string& path, const vector<nbody>& list, const vector<uint64_t>& seeds)
+	{
+		{
+			lock_guard<mutex> guard(this->lock);
+			Request* request = NULL;
+			for (int i=0;i<this->pending.size();i++)
+				if (this->pending[i].path == path)
+					request = &this->pending[i];
+			if (request == NULL)
+			{
+				//Buffers of earlier requests are reused so a save of the same size doesn't allocate
+				if (this->spare.size() > 0)
+				{
+					this->pending.push_back(move(this->spare.back()));
+					this->spare.pop_back();
+				}
+				else
+					this->pending.push_back(Request());
+				request = &this->pending.back();
+				request->path = path;
+			}
+			request->bodies.resize(list.size());
+			if (list.size() > 0)
+				memcpy(request->bodies.data(), list.data(), sizeof(nbody)*list.size());
+			request->seeds = seeds;
+		}
+		this->wake.notify_all();
+	}
+
+	//Blocks until every save made so far is on disk
+	void waitUntilIdle()
+	{
+		unique_lock<mutex> guard(this->lock);
+		this->idle.wait(guard, [this]() { return this->pending.size() == 0 && !this->writing; });
+	}
+
+	bool isBusy()
+	{
+		lock_guard<mutex> guard(this->lock);
+		return this->pending.size() > 0 || this->writing;
+	}
+
+private:
+	mutex lock;
+	condition_variable wake;
+	condition_variable idle;
+	deque<Request> pending;
+	vector<Request> spare;
+	bool writing = false;
+	bool stopping = false;
+	thread worker;
+
+	void run()
+	{
+#ifdef NBODY_IO_URING
+		UringWriter uring;
+		UringWriter* ring = &uring;
+#else
+		UringWriter* ring = NULL;
+#endif
+		string text;
+		while (true)
+		{
+			Request request;
+			{
+				unique_lock<mutex> guard(this->lock);
+				this->wake.wait(guard, [this]() { return this->pending.size() > 0 || this->stopping; });
+				if (this->pending.size() == 0)
+					return;
+				request = move(this->pending.front());
+				this->pending.pop_front();
+				this->writing = true;
+			}
+
+			formatNBodyList(request.bodies, request.seeds, &text);
+			if (!writeFileAtomically(request.path, text.data(), text.size(), ring))
+				std::cout << "Couldn't save " << request.path << "\n";
+
+			{
+				lock_guard<mutex> guard(this->lock);
+				this->spare.push_back(move(request));
+				this->writing = false;
+			}
+			this->idle.notify_all();
+		}
+	}
+};
+
+#endif
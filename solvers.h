@@ -0,0 +1,1299 @@
+#ifndef SOLVERS_H
+#define SOLVERS_H
+
+#include "nbody.h"
+#include <stdio.h>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <algorithm>
+#include <map>
+
+//One source acting on a receiver, shared by the CPU solvers so they behave exactly like the simple_add kernel
+//Real is the precision the distance and acceleration are worked out in, like REAL in the kernel
+//Returns true if curBody absorbed the target. Bodies absorbed in an earlier step stay in the list but no longer act on anything
+template <typename Real>
+inline bool interactBodies(nbody* curBody, const nbody& target, int i, int t, double timeStep)
+{
+	if (target.dead)
+		return false;
+
+	Real distX = (Real)target.x - (Real)curBody->x;
+	Real distY = (Real)target.y - (Real)curBody->y;
+	Real totalDist = sqrt(distX*distX + distY*distY);
+	if (totalDist == 0)
+		return false;
+
+	bool withinRange = totalDist < target.radius || totalDist < curBody->radius;
+	if ((withinRange && (curBody->mass >= target.mass || curBody->staticBody)) && !target.staticBody)
+	{
+		if (curBody->mass == target.mass && i < t)
+			return false;
+		curBody->velX = (curBody->mass*curBody->velX + target.mass*target.velX)/(curBody->mass+target.mass);
+		curBody->velY = (curBody->mass*curBody->velY + target.mass*target.velY)/(curBody->mass+target.mass);
+		curBody->mass += target.mass;
+		curBody->radius = cbrt(target.radius*target.radius*target.radius + curBody->radius*curBody->radius*curBody->radius);
+		return true;
+	}
+
+	Real accel = (Real)(target.mass*G)/(totalDist*totalDist);
+	curBody->velX += accel * distX/totalDist * timeStep;
+	curBody->velY += accel * distY/totalDist * timeStep;
+	return false;
+}
+
+//Moves the receiver by its new velocity and writes it out, the end of the kernel's per-body loop
+inline void integrateBody(nbody curBody, nbody* result, double timeStep)
+{
+	if (curBody.staticBody)
+	{
+		curBody.velX = 0;
+		curBody.velY = 0;
+	}
+
+	result->velX = curBody.velX;
+	result->velY = curBody.velY;
+	result->x = curBody.x + curBody.velX*timeStep;
+	result->y = curBody.y + curBody.velY*timeStep;
+	result->mass = curBody.mass;
+	result->radius = curBody.radius;
+	result->dead = false;
+}
+
+//CPU version of the simple_add kernel for machines without a usable OpenCL platform
+template <typename Real>
+void updateBodiesCPU(vector<nbody>* nbodyList)
+{
+	int n = nbodyList->size();
+	vector<nbody> A = *nbodyList;
+	//Each chunk records which bodies it absorbed, they are only marked dead after every chunk is done reading
+	vector<vector<int>> absorbed(getParallelChunkCount(n));
+
+	parallelFor(n, [&](int chunk, int start, int stop)
+	{
+		for (int i=start; i<stop; i++)
+		{
+			nbody curBody = A[i];
+			if (curBody.dead)
+				continue;
+			for (int t=0; t<n; t++)
+			{
+				if (i != t && interactBodies<Real>(&curBody, A[t], i, t, timeStep))
+					absorbed[chunk].push_back(t);
+			}
+
+			integrateBody(curBody, &nbodyList->at(i), timeStep);
+		}
+	});
+
+	for (int c=0;c<absorbed.size();c++)
+		for (int i=0;i<absorbed[c].size();i++)
+			nbodyList->at(absorbed[c][i]).dead = true;
+}
+
+void updateBodiesCPU(vector<nbody>* nbodyList)
+{
+	updateBodiesCPU<double>(nbodyList);
+}
+
+//Seconds per step measured at a few body counts, used to predict which solver is fastest for the current N
+struct SolverCalibration
+{
+	vector<int> counts;
+	vector<double> seconds;
+
+	//Interpolates in log-log space since step costs follow power laws (N^2 direct, close to N log N for the tree)
+	double predict(int n)
+	{
+		if (this->counts.size() == 0)
+			return 0;
+		if (this->counts.size() == 1)
+			return this->seconds[0]*n/this->counts[0];
+
+		int i = 0;
+		while (i < this->counts.size()-2 && n > this->counts[i+1])
+			i++;
+		double slope = log(this->seconds[i+1]/this->seconds[i]) / log((double)this->counts[i+1]/this->counts[i]);
+		return this->seconds[i]*pow((double)max(n, 1)/this->counts[i], slope);
+	}
+};
+
+//Common interface for the different ways of stepping the simulation
+class ForceSolver
+{
+public:
+	SolverCalibration calibration;
+	//Work out distances and forces in float rather than double, positions and velocities are still kept in double
+	bool singlePrecision = false;
+	//Memory the last step used on top of the body list itself, host and device
+	size_t memoryBytes = 0;
+
+	virtual ~ForceSolver() {}
+	//Short name used on the command line (--engine=name) and in the calibration cache
+	virtual string getName() = 0;
+	//Longer name for the window title
+	virtual string getDescription() = 0;
+	//Anything a cached calibration depends on besides the solver itself
+	virtual string getCalibrationKey()
+	{
+		return "threads=" + to_string(getThreadCount());
+	}
+	//Solvers set up by the background task can't be used, or even asked if they're available, until it finishes
+	virtual bool initializesInBackground() { return false; }
+	virtual bool isAvailable() { return true; }
+	//Advances nbodyList one step in place, absorbed bodies are flagged dead rather than removed
+	//Dead bodies are left alone, so the list can be stepped again without removing them and still line up with what was passed in
+	virtual void step(vector<nbody>* nbodyList) = 0;
+	//Advances nbodyList count steps, solvers that can keep the bodies on a device between steps override this
+	virtual void stepMany(vector<nbody>* nbodyList, int count)
+	{
+		for (int k=0;k<count;k++)
+			this->step(nbodyList);
+	}
+};
+
+//Direct O(N^2) summation on every CPU thread
+class CpuSolver : public ForceSolver
+{
+public:
+	string getName() { return "cpu"; }
+
+	string getDescription()
+	{
+		return "CPU direct (" + to_string(getThreadCount()) + " threads)";
+	}
+
+	void step(vector<nbody>* nbodyList)
+	{
+		if (this->singlePrecision)
+			updateBodiesCPU<float>(nbodyList);
+		else
+			updateBodiesCPU<double>(nbodyList);
+		//The copy of the sources, the absorbed lists are tiny next to it
+		this->memoryBytes = sizeof(nbody)*nbodyList->size();
+	}
+};
+
+//Barnes-Hut quadtree on every CPU thread, distant groups of bodies act as a single mass at their center of mass
+//Cells that could hold a body close enough to merge with are always opened, so collisions are still found exactly
+class TreeSolver : public ForceSolver
+{
+public:
+	//Cell size over distance below which a cell is approximated, smaller is more accurate and slower
+	double theta = 0.5;
+	int leafSize = 8;
+	//Coincident bodies can't be separated by splitting, stop before the recursion gets silly
+	int maxDepth = 48;
+
+	struct TreeNode
+	{
+		double centerX;
+		double centerY;
+		double halfSize;
+		double mass;
+		double comX;
+		double comY;
+		double maxRadius;
+		bool leaf;
+		int children[4];
+		//Range of the bodies under this node in the tree's body order
+		int begin;
+		int end;
+	};
+
+	string getName() { return "tree"; }
+
+	string getDescription()
+	{
+		return "Barnes-Hut tree (" + to_string(getThreadCount()) + " threads)";
+	}
+
+	int buildNode(vector<TreeNode>* nodes, const vector<nbody>& A, vector<int>* order, int begin, int end, double centerX, double centerY, double halfSize, int depth)
+	{
+		TreeNode node;
+		node.centerX = centerX;
+		node.centerY = centerY;
+		node.halfSize = halfSize;
+		node.mass = 0;
+		node.comX = 0;
+		node.comY = 0;
+		node.maxRadius = 0;
+		node.begin = begin;
+		node.end = end;
+		node.leaf = end - begin <= this->leafSize || depth >= this->maxDepth;
+		for (int k=0;k<4;k++)
+			node.children[k] = -1;
+
+		for (int k=begin;k<end;k++)
+		{
+			const nbody& body = A[order->at(k)];
+			node.mass += body.mass;
+			node.comX += body.mass*body.x;
+			node.comY += body.mass*body.y;
+			node.maxRadius = max(node.maxRadius, body.radius);
+		}
+
+		if (node.mass > 0)
+		{
+			node.comX /= node.mass;
+			node.comY /= node.mass;
+		}
+		else
+		{
+			node.comX = centerX;
+			node.comY = centerY;
+		}
+
+		int index = nodes->size();
+		nodes->push_back(node);
+		if (node.leaf)
+			return index;
+
+		//Split into the top and bottom halves, then each of those into left and right
+		vector<int>::iterator first = order->begin() + begin;
+		vector<int>::iterator last = order->begin() + end;
+		vector<int>::iterator middle = partition(first, last, [&](int b) { return A[b].y < centerY; });
+		vector<int>::iterator topSplit = partition(first, middle, [&](int b) { return A[b].x < centerX; });
+		vector<int>::iterator bottomSplit = partition(middle, last, [&](int b) { return A[b].x < centerX; });
+
+		int bounds[5] = {begin, (int)(topSplit - order->begin()), (int)(middle - order->begin()), (int)(bottomSplit - order->begin()), end};
+		double quarter = halfSize/2;
+		double offsetX[4] = {-quarter, quarter, -quarter, quarter};
+		double offsetY[4] = {-quarter, -quarter, quarter, quarter};
+		for (int k=0;k<4;k++)
+		{
+			if (bounds[k] == bounds[k+1])
+				continue;
+			//nodes can reallocate while the child is built, so don't hold on to a reference into it
+			int child = this->buildNode(nodes, A, order, bounds[k], bounds[k+1], centerX + offsetX[k], centerY + offsetY[k], quarter, depth + 1);
+			nodes->at(index).children[k] = child;
+		}
+
+		return index;
+	}
+
+	//The tree and everything else a step needs are locals, so calibration can run this alongside the render thread
+	void step(vector<nbody>* nbodyList)
+	{
+		if (this->singlePrecision)
+			this->stepTree<float>(nbodyList);
+		else
+			this->stepTree<double>(nbodyList);
+	}
+
+	template <typename Real>
+	void stepTree(vector<nbody>* nbodyList)
+	{
+		int n = nbodyList->size();
+		if (n == 0)
+			return;
+
+		vector<nbody> A = *nbodyList;
+
+		//Only live bodies go in the tree
+		vector<int> order;
+		order.reserve(n);
+		for (int i=0;i<n;i++)
+			if (!A[i].dead)
+				order.push_back(i);
+		if (order.size() == 0)
+			return;
+
+		double minX = A[order[0]].x, maxX = minX, minY = A[order[0]].y, maxY = minY;
+		for (int k=1;k<order.size();k++)
+		{
+			minX = min(minX, A[order[k]].x);
+			maxX = max(maxX, A[order[k]].x);
+			minY = min(minY, A[order[k]].y);
+			maxY = max(maxY, A[order[k]].y);
+		}
+
+		vector<TreeNode> nodes;
+		nodes.reserve(2*order.size()/this->leafSize + 16);
+		double halfSize = max(maxX - minX, maxY - minY)/2 + 1;
+		this->buildNode(&nodes, A, &order, 0, order.size(), (minX + maxX)/2, (minY + maxY)/2, halfSize, 0);
+
+		vector<vector<int>> absorbed(getParallelChunkCount(n));
+		parallelFor(n, [&](int chunk, int start, int stop)
+		{
+			vector<int> stack;
+			for (int i=start; i<stop; i++)
+			{
+				nbody curBody = A[i];
+				if (curBody.dead)
+					continue;
+				stack.push_back(0);
+				while (stack.size() > 0)
+				{
+					const TreeNode& node = nodes[stack.back()];
+					stack.pop_back();
+
+					if (node.leaf)
+					{
+						for (int k=node.begin;k<node.end;k++)
+						{
+							int t = order[k];
+							if (i != t && interactBodies<Real>(&curBody, A[t], i, t, timeStep))
+								absorbed[chunk].push_back(t);
+						}
+						continue;
+					}
+
+					Real distX = (Real)node.comX - (Real)curBody.x;
+					Real distY = (Real)node.comY - (Real)curBody.y;
+					Real totalDist = sqrt(distX*distX + distY*distY);
+					double cellX = node.centerX - curBody.x;
+					double cellY = node.centerY - curBody.y;
+					//The closest any body in the cell can be is the distance to its center less half its diagonal
+					double nearest = sqrt(cellX*cellX + cellY*cellY) - node.halfSize*1.4142136;
+					if (2*node.halfSize < this->theta*totalDist && nearest > max(node.maxRadius, curBody.radius))
+					{
+						Real accel = (Real)(node.mass*G)/(totalDist*totalDist);
+						curBody.velX += accel * distX/totalDist * timeStep;
+						curBody.velY += accel * distY/totalDist * timeStep;
+						continue;
+					}
+
+					for (int k=0;k<4;k++)
+						if (node.children[k] >= 0)
+							stack.push_back(node.children[k]);
+				}
+
+				integrateBody(curBody, &nbodyList->at(i), timeStep);
+			}
+		});
+
+		for (int c=0;c<absorbed.size();c++)
+			for (int i=0;i<absorbed[c].size();i++)
+				nbodyList->at(absorbed[c][i]).dead = true;
+
+		this->memoryBytes = sizeof(nbody)*n + sizeof(int)*order.capacity() + sizeof(TreeNode)*nodes.capacity();
+	}
+};
+
+//A device buffer that grows geometrically as bodies are added and hands memory back after merges shrink the list
+//Capacity is only bounded by the device's CL_DEVICE_MAX_MEM_ALLOC_SIZE
+class DeviceBuffer
+{
+public:
+	cl::Context context;
+	cl::Buffer buffer;
+	cl_mem_flags flags = CL_MEM_READ_WRITE;
+	size_t elementSize = 1;
+	//Both counted in elements
+	size_t capacity = 0;
+	size_t maxCapacity = 0;
+	//Never shrink below this, small lists come and go constantly while placing bodies
+	size_t minCapacity = 1024;
+
+	DeviceBuffer() {}
+
+	DeviceBuffer(const cl::Context& argContext, const cl::Device& device, cl_mem_flags argFlags, size_t argElementSize)
+	{
+		this->context = argContext;
+		this->flags = argFlags;
+		this->elementSize = argElementSize;
+		this->maxCapacity = device.getInfo<CL_DEVICE_MAX_MEM_ALLOC_SIZE>() / argElementSize;
+	}
+
+	//Makes room for count elements, doubling so that a growing list only reallocates O(log n) times
+	//The first preserveCount elements survive the move to the new allocation
+	bool reserve(const cl::CommandQueue& queue, size_t count, size_t preserveCount = 0)
+	{
+		if (count <= this->capacity)
+			return true;
+
+		if (count > this->maxCapacity)
+		{
+			std::cout << "Device buffer of " << count << " elements exceeds CL_DEVICE_MAX_MEM_ALLOC_SIZE (" << this->maxCapacity << " elements)\n";
+			return false;
+		}
+
+		size_t newCapacity = max(this->capacity, this->minCapacity);
+		while (newCapacity < count)
+			newCapacity *= 2;
+
+		return this->reallocate(queue, min(newCapacity, this->maxCapacity), preserveCount);
+	}
+
+	//Only shrink once usage falls to a quarter of capacity, and keep half the new allocation free,
+	//so a list hovering around a boundary doesn't reallocate every step
+	void shrink(const cl::CommandQueue& queue, size_t count)
+	{
+		if (this->capacity > this->minCapacity && count < this->capacity/4)
+			this->reallocate(queue, max(count*2, this->minCapacity), count);
+	}
+
+	bool reallocate(const cl::CommandQueue& queue, size_t newCapacity, size_t preserveCount)
+	{
+		cl_int err = CL_SUCCESS;
+		cl::Buffer newBuffer(this->context, this->flags, newCapacity*this->elementSize, NULL, &err);
+		if (err != CL_SUCCESS)
+		{
+			std::cout << "Failed to allocate device buffer of " << newCapacity << " elements (error " << err << ")\n";
+			return false;
+		}
+
+		preserveCount = min(preserveCount, min(this->capacity, newCapacity));
+		if (preserveCount > 0)
+			queue.enqueueCopyBuffer(this->buffer, newBuffer, 0, 0, preserveCount*this->elementSize);
+
+		this->buffer = newBuffer;
+		this->capacity = newCapacity;
+		return true;
+	}
+};
+
+//FNV-1a, only used to tell kernel builds apart so it doesn't need to be anything stronger
+uint64_t hashString(const string& str, uint64_t hash = 14695981039346656037ULL)
+{
+	for (int i=0;i<str.size();i++)
+	{
+		hash ^= (unsigned char)str[i];
+		hash *= 1099511628211ULL;
+	}
+
+	return hash;
+}
+
+//Everything that can invalidate a compiled binary goes into the key: the device, its driver, the kernel source and the build options
+string getProgramCacheKey(const cl::Device& device, const string& source, const string& options)
+{
+	return device.getInfo<CL_DEVICE_NAME>() + "|" + device.getInfo<CL_DRIVER_VERSION>() + "|" + to_string(hashString(source)) + "|" + options;
+}
+
+string getProgramCachePath(const string& key)
+{
+	char name[64];
+	snprintf(name, sizeof(name), "kernel_cache_%016llx.bin", (unsigned long long)hashString(key));
+	return name;
+}
+
+//Cache file layout: key length, key, binary length, binary
+//The full key is stored so a hash collision can never hand us a binary built for something else
+bool readProgramCache(const string& path, const string& key, vector<char>* binary)
+{
+	ifstream f;
+	f.open(path.c_str(), ios::in | ios::binary);
+	if (!f)
+		return false;
+
+	uint64_t keyLength = 0;
+	f.read((char*)&keyLength, sizeof(keyLength));
+	if (!f || keyLength != key.size())
+		return false;
+
+	string storedKey(keyLength, '\0');
+	f.read(&storedKey[0], keyLength);
+	if (!f || storedKey != key)
+		return false;
+
+	uint64_t binaryLength = 0;
+	f.read((char*)&binaryLength, sizeof(binaryLength));
+	if (!f || binaryLength == 0)
+		return false;
+
+	binary->resize(binaryLength);
+	f.read(binary->data(), binaryLength);
+	return (bool)f;
+}
+
+void writeProgramCache(const string& path, const string& key, const cl::Program& program)
+{
+	vector<size_t> sizes = program.getInfo<CL_PROGRAM_BINARY_SIZES>();
+	if (sizes.size() == 0 || sizes[0] == 0)
+		return;
+
+	//cl.hpp allocates each binary with new[] and leaves freeing them to us
+	vector<char*> binaries = program.getInfo<CL_PROGRAM_BINARIES>();
+
+	//Write to a temporary file first so an interrupted write never leaves a truncated binary under the real name
+	string tempPath = path + ".tmp";
+	ofstream f;
+	f.open(tempPath.c_str(), ios::out | ios::binary | ios::trunc);
+	uint64_t keyLength = key.size();
+	uint64_t binaryLength = sizes[0];
+	f.write((const char*)&keyLength, sizeof(keyLength));
+	f.write(key.data(), keyLength);
+	f.write((const char*)&binaryLength, sizeof(binaryLength));
+	f.write(binaries[0], binaryLength);
+	bool written = (bool)f;
+	f.close();
+
+	for (int i=0;i<binaries.size();i++)
+		delete[] binaries[i];
+
+	remove(path.c_str());
+	if (!written || rename(tempPath.c_str(), path.c_str()) != 0)
+		remove(tempPath.c_str());
+}
+
+//Building from source can take seconds on some CPU drivers, so reuse the binary from a previous run when we can
+//Any problem with the cached binary (missing, stale, rejected by the driver) just falls back to a normal build
+bool buildProgram(const cl::Context& context, const cl::Device& device, const string& source, const string& options, cl::Program* program)
+{
+	string key = getProgramCacheKey(device, source, options);
+	string path = getProgramCachePath(key);
+
+	vector<char> binary;
+	if (readProgramCache(path, key, &binary))
+	{
+		cl::Program::Binaries binaries;
+		binaries.push_back(make_pair((const void*)binary.data(), binary.size()));
+		vector<cl_int> binaryStatus;
+		cl_int err = CL_SUCCESS;
+		*program = cl::Program(context, {device}, binaries, &binaryStatus, &err);
+		if (err == CL_SUCCESS && binaryStatus.size() == 1 && binaryStatus[0] == CL_SUCCESS && program->build({device}, options.c_str()) == CL_SUCCESS)
+		{
+			std::cout << "Loaded cached kernel binary: " << path << "\n";
+			return true;
+		}
+
+		std::cout << "Cached kernel binary rejected, rebuilding from source\n";
+	}
+
+	cl::Program::Sources sources;
+	sources.push_back({source.c_str(), source.length()});
+
+	*program = cl::Program(context, sources);
+	if (program->build({device}, options.c_str()) != CL_SUCCESS) {
+		std::cout << "Error building: " << program->getBuildInfo<CL_PROGRAM_BUILD_LOG>(device) << std::endl;
+		return false;
+	}
+
+	writeProgramCache(path, key, *program);
+	return true;
+}
+
+// calculates for each receiver in [offset, offset+count); C = A + B
+// C only holds that slice, D holds the stamp of the step each body (from any slice) was absorbed in, 0 while it is alive
+// a source absorbed in an earlier step (stamp below this one's) is skipped, one absorbed during this step still acts in it
+// distances and forces are worked out in REAL, building with -DREAL=float trades accuracy for speed on devices with slow doubles
+const string kernel_code=
+	"#ifndef REAL\n"
+	"#define REAL double\n"
+	"#endif\n"
+	"typedef struct __attribute__ ((packed)) {"
+	"	double x;"
+	"	double y;"
+	"	double velX;"
+	"	double velY;"
+	"	double radius;"
+	"	int mass;"
+	"	uint id;"
+	"	bool staticBody;"
+	"   bool dead;"
+	"} nbody;"
+	""
+	"   void kernel simple_add(global const nbody* A, global nbody* C, global const int* N, global int* D, int offset, int count, int stamp) {"
+	"       int ID, Nthreads, n, ratio, start, stop;"
+	"		double timeStep, G;"
+	""
+	"       ID = get_global_id(0);"
+	"       Nthreads = get_global_size(0);"
+	"		n = N[0];"
+	""
+	"       ratio = (count / Nthreads);"  // number of elements for each thread
+	"       start = offset + ratio * ID;"
+	"       stop  = offset + ratio * (ID + 1);"
+	"		timeStep = .1;"
+	"		G = 1;"
+	"       for (int i=start; i<stop; i++){"
+	"           nbody curBody = A[i];"
+	"			if (D[i]) continue;"
+	"			for (int t=0; t < n; t++)"
+	"			{"
+	"				int absorbedAt = D[t];"
+	"				if (i != t && (absorbedAt == 0 || absorbedAt >= stamp))"
+	"				{"
+	"					nbody target = A[t];"
+	"					REAL distX = (REAL)target.x - (REAL)curBody.x;"
+	"					REAL distY = (REAL)target.y - (REAL)curBody.y;"
+	"					REAL totalDist = sqrt(distX*distX + distY*distY);"
+	"					if (totalDist == 0) continue;"
+	""
+	"					bool withinRange = totalDist < target.radius || totalDist < curBody.radius;"
+	"					if ((withinRange && (curBody.mass >= target.mass || curBody.staticBody)) && !target.staticBody)"
+	"					{"
+	"						if (curBody.mass == target.mass && i < t)"
+	"							continue;"
+	"						curBody.velX = (curBody.mass*curBody.velX + target.mass*target.velX)/(curBody.mass+target.mass);"
+	"						curBody.velY = (curBody.mass*curBody.velY + target.mass*target.velY)/(curBody.mass+target.mass);"
+	"						curBody.mass += target.mass;"
+	"						curBody.radius = cbrt(target.radius*target.radius*target.radius + curBody.radius*curBody.radius*curBody.radius);"
+	"						D[t] = stamp;"
+	"					}"
+	"					else"
+	"					{"
+	"						REAL accel = (REAL)(target.mass*G)/(totalDist*totalDist);"
+	"						REAL accX = accel * distX/totalDist;"
+	"						REAL accY = accel * distY/totalDist;"
+	"						curBody.velX += accX*timeStep;"
+	"						curBody.velY += accY*timeStep;"
+	"					}"
+	"				}"	
+	"			}"
+	""
+	"			if (curBody.staticBody){"
+	"				curBody.velX = 0;"
+	"				curBody.velY = 0;"
+	"			}"
+	""			
+	"           int out = i - offset;"
+	"           C[out].velX = curBody.velX;"
+	"           C[out].velY = curBody.velY;"
+	" 			C[out].x = curBody.x + curBody.velX*timeStep;"
+	"			C[out].y = curBody.y + curBody.velY*timeStep;"
+	"			C[out].mass = curBody.mass;"
+	"			C[out].radius = curBody.radius;"
+	"			C[out].id = curBody.id;"
+	"			C[out].staticBody = curBody.staticBody;"
+	"			C[out].dead = false;"
+	"		}"
+	"   }";
+
+//One device taking part in the step. Each gets its own context, program and buffers so devices from different platforms can be mixed
+struct ClDevice
+{
+	cl::Device device;
+	cl::Context context;
+	cl::Program program;
+	cl::CommandQueue queue;
+	DeviceBuffer buffer_A;
+	DeviceBuffer buffer_C;
+	DeviceBuffer buffer_D;
+	cl::Buffer buffer_N;
+	//Receivers per second from kernel profiling, this decides how big a slice the device gets
+	double throughput = 0;
+	//The receivers [sliceStart, sliceStop) this device computes in the current step
+	int sliceStart = 0;
+	int sliceStop = 0;
+	//Devices sharing memory with the host (CPU runtimes, integrated GPUs) are read and written through mapped buffers,
+	//for those a read/write would just be a memcpy between two regions of the same RAM
+	bool hostUnified = false;
+	//Readback targets for devices that go through the copy path
+	vector<nbody> results;
+	vector<cl_int> absorbed;
+	cl::Event kernelEvent;
+	//Everything that has to complete before this device's results can be read
+	vector<cl::Event> doneEvents;
+	//Created once, only the arguments change between steps
+	cl::Kernel simple_add;
+	//The same kernel built with REAL=float, only built the first time single precision is asked for
+	cl::Program singleProgram;
+	cl::Kernel simple_add_single;
+	bool singleBuilt = false;
+};
+
+//A CPU device spanning several NUMA nodes is split into one sub-device per node so each slice works out of local memory
+vector<cl::Device> splitByNumaDomain(cl::Device device)
+{
+	vector<cl::Device> subDevices;
+	if (device.getInfo<CL_DEVICE_TYPE>() & CL_DEVICE_TYPE_CPU)
+	{
+		cl_device_partition_property properties[] = {CL_DEVICE_PARTITION_BY_AFFINITY_DOMAIN, CL_DEVICE_AFFINITY_DOMAIN_NUMA, 0};
+		if (device.createSubDevices(properties, &subDevices) == CL_SUCCESS && subDevices.size() > 1)
+			return subDevices;
+	}
+
+	return vector<cl::Device>(1, device);
+}
+
+bool initClDevice(cl::Device device, ClDevice* clDevice)
+{
+	clDevice->device = device;
+	std::cout<< "Using device: "<<device.getInfo<CL_DEVICE_NAME>()<<"\n";
+
+	// a context is like a "runtime link" to the device and platform;
+	// i.e. communication is possible
+	clDevice->context = cl::Context({device});
+
+	// create the program that we want to execute on the device
+	if (!buildProgram(clDevice->context, device, kernel_code, "", &clDevice->program))
+		return false;
+	clDevice->simple_add = cl::Kernel(clDevice->program, "simple_add");
+
+	// create a queue (a queue of commands that the GPU will execute)
+	// profiling is on so each device's kernel time can be measured for load balancing
+	clDevice->queue = cl::CommandQueue(clDevice->context, device, CL_QUEUE_PROFILING_ENABLE);
+
+	// create buffers on device (allocate space on GPU)
+	// the body buffers are sized on first use and grow with the list
+	// on host-unified devices they are allocated in host memory the runtime can hand to us directly when mapped
+	clDevice->hostUnified = device.getInfo<CL_DEVICE_HOST_UNIFIED_MEMORY>();
+	cl_mem_flags hostFlags = clDevice->hostUnified ? CL_MEM_ALLOC_HOST_PTR : 0;
+	// A and C are both read and written since several steps in a row swap them
+	clDevice->buffer_A = DeviceBuffer(clDevice->context, device, CL_MEM_READ_WRITE | hostFlags, sizeof(nbody));
+	clDevice->buffer_C = DeviceBuffer(clDevice->context, device, CL_MEM_READ_WRITE | hostFlags, sizeof(nbody));
+	clDevice->buffer_D = DeviceBuffer(clDevice->context, device, CL_MEM_READ_WRITE | hostFlags, sizeof(cl_int));
+	clDevice->buffer_N = cl::Buffer(clDevice->context, CL_MEM_READ_ONLY,  sizeof(int));
+
+	return true;
+}
+
+//Owns every OpenCL device taking part in the simulation along with their queues, kernels and buffers
+//It lives for the whole run so a step only enqueues work, nothing is created or copied per step
+class ClEngine : public ForceSolver
+{
+public:
+	vector<ClDevice> devices;
+	//Set from the result of init by the background task
+	bool available = false;
+	//Overlap the next step with drawing the current one, at the cost of showing results a step late
+	bool pipelined = false;
+	//Host memory the non-blocking writes read from, kept alive here until the step completes
+	int N[1];
+	//Dead bodies go in as absorbed before the first step
+	vector<cl_int> deadStamps;
+	//Sources of the step in flight when pipelining
+	vector<nbody> staging;
+	bool stepInFlight = false;
+
+	//Returns false when there is no usable platform, device or kernel build so the caller can fall back to the CPU
+	bool init()
+	{
+		// get all platforms (drivers), e.g. NVIDIA
+		std::vector<cl::Platform> all_platforms;
+		cl::Platform::get(&all_platforms);
+
+		if (all_platforms.size()==0) {
+			std::cout<<" No platforms found. Check OpenCL installation!\n";
+			return false;
+		}
+
+		//Every device (CPUs, GPUs) on every platform computes a share of the step
+		for (int p=0;p<all_platforms.size();p++)
+		{
+			std::cout << "Using platform: "<<all_platforms[p].getInfo<CL_PLATFORM_NAME>()<<"\n";
+
+			std::vector<cl::Device> all_devices;
+			all_platforms[p].getDevices(CL_DEVICE_TYPE_ALL, &all_devices);
+			for (int d=0;d<all_devices.size();d++)
+			{
+				vector<cl::Device> devices = splitByNumaDomain(all_devices[d]);
+				for (int s=0;s<devices.size();s++)
+				{
+					ClDevice clDevice;
+					if (initClDevice(devices[s], &clDevice))
+						this->devices.push_back(clDevice);
+				}
+			}
+		}
+
+		if(this->devices.size()==0){
+			std::cout<<" No devices found. Check OpenCL installation!\n";
+			return false;
+		}
+
+		return true;
+	}
+
+	string getName() { return "opencl"; }
+
+	string getDescription()
+	{
+		if (this->devices.size() == 1)
+			return this->devices[0].device.getInfo<CL_DEVICE_NAME>();
+
+		return to_string(this->devices.size()) + " OpenCL devices";
+	}
+
+	string getCalibrationKey()
+	{
+		string key;
+		for (int d=0;d<this->devices.size();d++)
+			key += this->devices[d].device.getInfo<CL_DEVICE_NAME>() + " " + this->devices[d].device.getInfo<CL_DRIVER_VERSION>() + ";";
+		return key;
+	}
+
+	bool initializesInBackground() { return true; }
+	bool isAvailable() { return this->available; }
+
+	//Steps nbodyList in place
+	void step(vector<nbody>* nbodyList)
+	{
+		if (this->pipelined)
+		{
+			this->stepPipelined(nbodyList);
+			return;
+		}
+
+		this->discardStep();
+		if (nbodyList->size() == 0)
+			return;
+
+		if (!this->enqueueStep(*nbodyList))
+		{
+			//Too big for a single allocation on this device, the CPU can still step it
+			updateBodiesCPU(nbodyList);
+			return;
+		}
+
+		this->gatherStep(nbodyList);
+	}
+
+	//Pipelined version of step: leaves step k in nbodyList for drawing while step k+1 is already running on the devices
+	//The list handed back is one step behind the devices. As long as the caller passes it back unchanged the next call
+	//only has to collect the step in flight. If the caller changed it (placed, cleared or loaded bodies) the in-flight
+	//step is dropped and one step is run synchronously from the new list
+	void stepPipelined(vector<nbody>* nbodyList)
+	{
+		vector<nbody>& staging = this->staging;
+		bool unchanged = nbodyList->size() == staging.size() && (staging.size() == 0 || memcmp(nbodyList->data(), staging.data(), sizeof(nbody)*staging.size()) == 0);
+
+		if (!this->stepInFlight || !unchanged)
+		{
+			this->discardStep();
+			staging = *nbodyList;
+			if (staging.size() == 0)
+				return;
+			if (!this->enqueueStep(staging))
+			{
+				staging.clear();
+				updateBodiesCPU(nbodyList);
+				return;
+			}
+		}
+
+		//staging is only touched once the step reading from it has finished
+		//Merged bodies stay in it, the next step uploads them as already absorbed
+		this->gatherStep(&staging);
+
+		if (staging.size() > 0 && !this->enqueueStep(staging))
+			this->stepInFlight = false;
+
+		//The caller gets its own copy since the devices may still be reading staging
+		//Assigning reuses the list's storage so this is a single memcpy once it has grown to size
+		*nbodyList = staging;
+	}
+
+	//Splits the receivers between devices in proportion to their measured throughput
+	//Until every device has been measured they all get an equal share
+	void balanceSlices(int n)
+	{
+		int deviceCount = this->devices.size();
+		bool measured = true;
+		double totalThroughput = 0;
+		for (int d=0;d<deviceCount;d++)
+		{
+			if (this->devices[d].throughput <= 0)
+				measured = false;
+			totalThroughput += this->devices[d].throughput;
+		}
+
+		double share = 0;
+		int start = 0;
+		for (int d=0;d<deviceCount;d++)
+		{
+			ClDevice& device = this->devices[d];
+			share += measured ? device.throughput/totalThroughput : 1.0/deviceCount;
+			int stop = d == deviceCount-1 ? n : (int)(share*n + .5);
+			device.sliceStart = start;
+			device.sliceStop = max(start, min(n, stop));
+			start = device.sliceStop;
+		}
+	}
+
+	//Uploads sources to every device and enqueues its slice of the step without waiting for any of it
+	//Returns false if a device can't hold the list, nothing has been enqueued in that case
+	bool enqueueStep(const vector<nbody>& sources)
+	{
+		// apparently OpenCL only likes arrays ...
+		// N holds the number of elements in the vectors we want to add
+		// it lives in the backend because the writes below may still be reading it after we return
+		int n = sources.size();
+		this->N[0] = n;
+		this->deadStamps.resize(n);
+		for (int i=0;i<n;i++)
+			this->deadStamps[i] = sources[i].dead ? 1 : 0;
+
+		balanceSlices(n);
+
+		//Every device needs the whole list as sources but only holds results for its own slice
+		for (int d=0;d<this->devices.size();d++)
+		{
+			ClDevice& device = this->devices[d];
+			int count = device.sliceStop - device.sliceStart;
+			device.buffer_A.shrink(device.queue, n);
+			device.buffer_C.shrink(device.queue, count);
+			device.buffer_D.shrink(device.queue, n);
+			if (!device.buffer_A.reserve(device.queue, n) || !device.buffer_C.reserve(device.queue, max(count, 1)) || !device.buffer_D.reserve(device.queue, n))
+				return false;
+		}
+
+		// push every device's commands before waiting on any of them so they run side by side
+		for (int d=0;d<this->devices.size();d++)
+		{
+			ClDevice& device = this->devices[d];
+			int count = device.sliceStop - device.sliceStart;
+			if (count == 0)
+				continue;
+
+			if (device.hostUnified)
+			{
+				void* mappedA = device.queue.enqueueMapBuffer(device.buffer_A.buffer, CL_TRUE, CL_MAP_WRITE, 0, sizeof(nbody)*n);
+				memcpy(mappedA, &sources[0], sizeof(nbody)*n);
+				device.queue.enqueueUnmapMemObject(device.buffer_A.buffer, mappedA);
+				void* mappedD = device.queue.enqueueMapBuffer(device.buffer_D.buffer, CL_TRUE, CL_MAP_WRITE, 0, sizeof(cl_int)*n);
+				memcpy(mappedD, this->deadStamps.data(), sizeof(cl_int)*n);
+				device.queue.enqueueUnmapMemObject(device.buffer_D.buffer, mappedD);
+			}
+			else
+			{
+				device.queue.enqueueWriteBuffer(device.buffer_A.buffer, CL_FALSE, 0, sizeof(nbody)*n, &sources[0]);
+				device.queue.enqueueWriteBuffer(device.buffer_D.buffer, CL_FALSE, 0, sizeof(cl_int)*n, this->deadStamps.data());
+			}
+			device.queue.enqueueWriteBuffer(device.buffer_N, CL_FALSE, 0, sizeof(int),   this->N);
+
+			// RUN ZE KERNEL
+			// buffers are set every step since growing or shrinking replaces them
+			cl::Kernel& simple_add = this->getKernel(device);
+			simple_add.setArg(0, device.buffer_A.buffer);
+			simple_add.setArg(1, device.buffer_C.buffer);
+			simple_add.setArg(2, device.buffer_N);
+			simple_add.setArg(3, device.buffer_D.buffer);
+			simple_add.setArg(4, device.sliceStart);
+			simple_add.setArg(5, count);
+			simple_add.setArg(6, 2);
+			device.queue.enqueueNDRangeKernel(simple_add, cl::NullRange, cl::NDRange(count), cl::NullRange, NULL, &device.kernelEvent);
+			device.doneEvents.assign(1, device.kernelEvent);
+
+			// read result from GPU to here
+			// host-unified devices skip this, their results are read in place through a mapping once the kernel is done
+			if (!device.hostUnified)
+			{
+				device.results.resize(count);
+				device.absorbed.resize(n);
+				device.doneEvents.resize(3);
+				device.queue.enqueueReadBuffer(device.buffer_C.buffer, CL_FALSE, 0, sizeof(nbody)*count, device.results.data(), NULL, &device.doneEvents[1]);
+				device.queue.enqueueReadBuffer(device.buffer_D.buffer, CL_FALSE, 0, sizeof(cl_int)*n, device.absorbed.data(), NULL, &device.doneEvents[2]);
+			}
+			device.queue.flush();
+		}
+
+		this->memoryBytes = 0;
+		for (int d=0;d<this->devices.size();d++)
+		{
+			ClDevice& device = this->devices[d];
+			this->memoryBytes += device.buffer_A.capacity*device.buffer_A.elementSize + device.buffer_C.capacity*device.buffer_C.elementSize + device.buffer_D.capacity*device.buffer_D.elementSize;
+			this->memoryBytes += sizeof(nbody)*device.results.capacity() + sizeof(cl_int)*device.absorbed.capacity();
+		}
+
+		this->stepInFlight = true;
+		return true;
+	}
+
+	//Waits for the step started by enqueueStep and copies its results into nbodyList, which must hold the sources it was given
+	void gatherStep(vector<nbody>* nbodyList)
+	{
+		int n = nbodyList->size();
+		this->stepInFlight = false;
+
+		for (int d=0;d<this->devices.size();d++)
+		{
+			ClDevice& device = this->devices[d];
+			int count = device.sliceStop - device.sliceStart;
+			if (count == 0)
+				continue;
+
+			cl::Event::waitForEvents(device.doneEvents);
+
+			//Kernel time only (profiling counters are in ns), so transfers and waiting on other devices don't skew the balance
+			double seconds = (device.kernelEvent.getProfilingInfo<CL_PROFILING_COMMAND_END>() - device.kernelEvent.getProfilingInfo<CL_PROFILING_COMMAND_START>()) * 1e-9;
+			if (seconds > 0)
+			{
+				double throughput = count/seconds;
+				device.throughput = device.throughput > 0 ? device.throughput*.8 + throughput*.2 : throughput;
+			}
+		}
+
+		for (int d=0;d<this->devices.size();d++)
+		{
+			ClDevice& device = this->devices[d];
+			int count = device.sliceStop - device.sliceStart;
+			if (count == 0)
+				continue;
+
+			const nbody* C = device.results.data();
+			const cl_int* absorbed = device.absorbed.data();
+			if (device.hostUnified)
+			{
+				C = (const nbody*)device.queue.enqueueMapBuffer(device.buffer_C.buffer, CL_TRUE, CL_MAP_READ, 0, sizeof(nbody)*count);
+				absorbed = (const cl_int*)device.queue.enqueueMapBuffer(device.buffer_D.buffer, CL_TRUE, CL_MAP_READ, 0, sizeof(cl_int)*n);
+			}
+
+			//Receivers that were already dead aren't written by the kernel
+			for (int i=0;i<count;i++)
+			{
+				nbody& curBody = nbodyList->at(device.sliceStart + i);
+				if (curBody.dead)
+					continue;
+				curBody.x = C[i].x;
+				curBody.y = C[i].y;
+				curBody.velX = C[i].velX;
+				curBody.velY = C[i].velY;
+				curBody.mass = C[i].mass;
+				curBody.radius = C[i].radius;
+			}
+
+			for (int i=0;i<n;i++)
+				if (absorbed[i])
+					nbodyList->at(i).dead = true;
+
+			if (device.hostUnified)
+			{
+				device.queue.enqueueUnmapMemObject(device.buffer_C.buffer, (void*)C);
+				device.queue.enqueueUnmapMemObject(device.buffer_D.buffer, (void*)absorbed);
+			}
+		}
+	}
+
+	//Runs count steps back to back on a single device, swapping A and C between steps so the bodies only cross to the device
+	//and back once. Several devices each only hold their own slice of the results so they have to meet on the host after every step
+	void stepMany(vector<nbody>* nbodyList, int count)
+	{
+		if (this->pipelined || this->devices.size() != 1 || count == 1)
+		{
+			ForceSolver::stepMany(nbodyList, count);
+			return;
+		}
+
+		this->discardStep();
+		int n = nbodyList->size();
+		if (n == 0)
+			return;
+
+		ClDevice& device = this->devices[0];
+		device.sliceStart = 0;
+		device.sliceStop = n;
+		device.buffer_A.shrink(device.queue, n);
+		device.buffer_C.shrink(device.queue, n);
+		device.buffer_D.shrink(device.queue, n);
+		if (!device.buffer_A.reserve(device.queue, n) || !device.buffer_C.reserve(device.queue, n) || !device.buffer_D.reserve(device.queue, n))
+		{
+			for (int k=0;k<count;k++)
+				updateBodiesCPU(nbodyList);
+			return;
+		}
+
+		this->N[0] = n;
+		this->deadStamps.resize(n);
+		for (int i=0;i<n;i++)
+			this->deadStamps[i] = nbodyList->at(i).dead ? 1 : 0;
+		device.queue.enqueueWriteBuffer(device.buffer_A.buffer, CL_FALSE, 0, sizeof(nbody)*n, nbodyList->data());
+		device.queue.enqueueWriteBuffer(device.buffer_D.buffer, CL_FALSE, 0, sizeof(cl_int)*n, this->deadStamps.data());
+		device.queue.enqueueWriteBuffer(device.buffer_N, CL_FALSE, 0, sizeof(int), this->N);
+
+		//Every step gets its own stamp so the kernel can tell bodies absorbed in earlier steps from ones absorbed in this one
+		cl::Kernel& simple_add = this->getKernel(device);
+		DeviceBuffer* sources = &device.buffer_A;
+		DeviceBuffer* results = &device.buffer_C;
+		for (int k=0;k<count;k++)
+		{
+			simple_add.setArg(0, sources->buffer);
+			simple_add.setArg(1, results->buffer);
+			simple_add.setArg(2, device.buffer_N);
+			simple_add.setArg(3, device.buffer_D.buffer);
+			simple_add.setArg(4, 0);
+			simple_add.setArg(5, n);
+			simple_add.setArg(6, k + 2);
+			device.queue.enqueueNDRangeKernel(simple_add, cl::NullRange, cl::NDRange(n), cl::NullRange);
+			swap(sources, results);
+		}
+
+		//The last step's results are in sources after the swap
+		device.results.resize(n);
+		device.absorbed.resize(n);
+		device.queue.enqueueReadBuffer(sources->buffer, CL_FALSE, 0, sizeof(nbody)*n, device.results.data());
+		device.queue.enqueueReadBuffer(device.buffer_D.buffer, CL_FALSE, 0, sizeof(cl_int)*n, device.absorbed.data());
+		device.queue.finish();
+
+		for (int i=0;i<n;i++)
+		{
+			nbody& curBody = nbodyList->at(i);
+			if (device.absorbed[i])
+				curBody.dead = true;
+			else
+				curBody = device.results[i];
+		}
+
+		this->memoryBytes = device.buffer_A.capacity*device.buffer_A.elementSize + device.buffer_C.capacity*device.buffer_C.elementSize + device.buffer_D.capacity*device.buffer_D.elementSize;
+		this->memoryBytes += sizeof(nbody)*device.results.capacity() + sizeof(cl_int)*device.absorbed.capacity();
+	}
+
+	//The kernel to run on device at the current precision, falls back to double if the float build fails
+	cl::Kernel& getKernel(ClDevice& device)
+	{
+		if (!this->singlePrecision)
+			return device.simple_add;
+
+		if (!device.singleBuilt)
+		{
+			device.singleBuilt = true;
+			if (buildProgram(device.context, device.device, kernel_code, "-DREAL=float", &device.singleProgram))
+				device.simple_add_single = cl::Kernel(device.singleProgram, "simple_add");
+			else
+				device.simple_add_single = device.simple_add;
+		}
+
+		return device.simple_add_single;
+	}
+
+	//Drops a pipelined step whose sources have since been replaced
+	void discardStep()
+	{
+		if (!this->stepInFlight)
+			return;
+
+		for (int d=0;d<this->devices.size();d++)
+			this->devices[d].queue.finish();
+		this->stepInFlight = false;
+	}
+};
+
+//Deterministic uniform field at the density of the 'P' field, so calibration steps cost what real ones do
+vector<nbody> makeCalibrationField(int massCount)
+{
+	vector<nbody> field;
+	placeRandomField(massCount, 5, 7200*sqrt(massCount/40000.0), 0, 0, 12345, &field);
+	return field;
+}
+
+//Calibration cache lines are: solver name, tab, calibration key, tab, then "count seconds" pairs
+map<string, string> readCalibrationCache()
+{
+	map<string, string> cache;
+	ifstream f;
+	f.open("nbody_calibration.txt", ios::in);
+
+	string line;
+	while (getline(f, line))
+	{
+		size_t split = line.rfind('\t');
+		if (split != string::npos)
+			cache[line.substr(0, split)] = line.substr(split + 1);
+	}
+
+	return cache;
+}
+
+void writeCalibrationCache(const map<string, string>& cache)
+{
+	ofstream f;
+	f.open("nbody_calibration.txt", ios::out);
+	for (map<string, string>::const_iterator it = cache.begin(); it != cache.end(); ++it)
+		f << it->first << "\t" << it->second << "\n";
+}
+
+//Times each available solver at a few body counts so automatic selection can predict the fastest one for any N
+//Results are cached per solver and machine, only the first run (or a run after a driver change) pays for the timing
+void calibrateSolvers(vector<ForceSolver*> solvers)
+{
+	using namespace std::chrono;
+	int counts[] = {256, 1024, 4096, 16384};
+	map<string, string> cache = readCalibrationCache();
+	bool changed = false;
+
+	for (int s=0;s<solvers.size();s++)
+	{
+		ForceSolver* solver = solvers[s];
+		if (!solver->isAvailable())
+			continue;
+
+		string key = solver->getName() + "\t" + solver->getCalibrationKey();
+		SolverCalibration calibration;
+		if (cache.count(key))
+		{
+			istringstream values(cache[key]);
+			int count;
+			double seconds;
+			while (values >> count >> seconds)
+			{
+				calibration.counts.push_back(count);
+				calibration.seconds.push_back(seconds);
+			}
+		}
+
+		if (calibration.counts.size() == 0)
+		{
+			ostringstream values;
+			for (int c=0;c<sizeof(counts)/sizeof(counts[0]);c++)
+			{
+				vector<nbody> field = makeCalibrationField(counts[c]);
+				//The first step pays for thread startup and the first kernel launch
+				vector<nbody> bodies = field;
+				solver->step(&bodies);
+
+				double best = 1e30;
+				for (int r=0;r<3;r++)
+				{
+					bodies = field;
+					steady_clock::time_point start = steady_clock::now();
+					solver->step(&bodies);
+					best = min(best, duration<double>(steady_clock::now() - start).count());
+				}
+
+				best = max(best, 1e-9);
+				calibration.counts.push_back(counts[c]);
+				calibration.seconds.push_back(best);
+				values << counts[c] << " " << best << " ";
+
+				//Anything bigger would take too long, the fit extrapolates from here
+				if (best > .25)
+					break;
+			}
+
+			cache[key] = values.str();
+			changed = true;
+		}
+
+		std::cout << "Calibrated " << solver->getName() << ": " << calibration.predict(40000)*1000 << " ms per step at 40000 bodies\n";
+		solver->calibration = calibration;
+	}
+
+	if (changed)
+		writeCalibrationCache(cache);
+}
+
+//Picks the solver to step with this frame, or NULL while the solvers are still being set up and calibrated
+//choice is a solver name or "auto", which picks whichever the calibration predicts is fastest for n bodies
+ForceSolver* selectSolver(vector<ForceSolver*> solvers, const string& choice, bool backendReady, int n)
+{
+	ForceSolver* chosen = NULL;
+	for (int s=0;s<solvers.size();s++)
+		if (solvers[s]->getName() == choice)
+			chosen = solvers[s];
+
+	//Nothing steps until calibration is done, it steps the same solver objects and its timings would be skewed by sharing the cores
+	if (!backendReady)
+		return NULL;
+	if (chosen != NULL && chosen->isAvailable())
+		return chosen;
+
+	//Either "auto" or the solver asked for couldn't be set up
+	ForceSolver* fastest = NULL;
+	double fastestSeconds = 0;
+	for (int s=0;s<solvers.size();s++)
+	{
+		if (!solvers[s]->isAvailable() || solvers[s]->calibration.counts.size() == 0)
+			continue;
+
+		double seconds = solvers[s]->calibration.predict(n);
+		if (fastest == NULL || seconds < fastestSeconds)
+		{
+			fastest = solvers[s];
+			fastestSeconds = seconds;
+		}
+	}
+
+	if (fastest == NULL)
+	{
+		for (int s=0;s<solvers.size();s++)
+			if (!solvers[s]->initializesInBackground())
+				return solvers[s];
+	}
+
+	return fastest;
+}
+
+#endif
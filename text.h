@@ -0,0 +1,169 @@
+#ifndef TEXT_H
+#define TEXT_H
+
+#include "SDL/include/SDL.h"
+#include "SDL/include/SDL_ttf.h"
+#include <iostream>
+#include <string.h>
+#include <string>
+#include <map>
+#include <utility>
+
+using namespace std;
+
+const char* fontPath = "C:/Windows/Fonts/arial.ttf";
+
+//One font handle per size for the whole process, closed by closeTextCache
+map<int, TTF_Font*> fontCache;
+
+TTF_Font* getFont(int size)
+{
+	map<int, TTF_Font*>::iterator it = fontCache.find(size);
+	if (it != fontCache.end())
+		return it->second;
+
+	TTF_Font* font = TTF_OpenFont(fontPath, size);
+	if (font == NULL)
+		std::cout << "Couldn't open font " << fontPath << ": " << TTF_GetError() << "\n";
+	fontCache[size] = font;
+	return font;
+}
+
+//Every printable ASCII character of one font rasterized once into a single texture
+//Text is drawn as one copy per character out of it, so changing text costs nothing and drawing never switches textures
+//SDL 2.0.8 has no SDL_RenderGeometry, newer versions batch the copies from one texture by themselves
+class GlyphAtlas
+{
+public:
+	static const int firstChar = 32;
+	static const int lastChar = 126;
+	SDL_Texture* texture = NULL;
+	SDL_Rect glyphs[lastChar - firstChar + 1];
+	int advances[lastChar - firstChar + 1];
+	int lineHeight = 0;
+
+	GlyphAtlas(SDL_Renderer* ren, TTF_Font* font)
+	{
+		memset(this->glyphs, 0, sizeof(this->glyphs));
+		memset(this->advances, 0, sizeof(this->advances));
+		if (font == NULL)
+			return;
+
+		this->lineHeight = TTF_FontHeight(font);
+
+		//Characters are rendered one by one so each lines up with the baseline the way it would in a whole string
+		SDL_Surface* rendered[lastChar - firstChar + 1];
+		SDL_Color white = {255, 255, 255};
+		int atlasWidth = 512;
+		int penX = 0;
+		int penY = 0;
+		for (int c=firstChar;c<=lastChar;c++)
+		{
+			int g = c - firstChar;
+			char text[2] = {(char)c, 0};
+			rendered[g] = TTF_RenderText_Blended(font, text, white);
+			int minX, maxX, minY, maxY;
+			this->advances[g] = 0;
+			TTF_GlyphMetrics(font, c, &minX, &maxX, &minY, &maxY, &this->advances[g]);
+
+			int w = rendered[g] != NULL ? rendered[g]->w : 0;
+			if (penX + w > atlasWidth)
+			{
+				penX = 0;
+				penY += this->lineHeight;
+			}
+			this->glyphs[g].x = penX;
+			this->glyphs[g].y = penY;
+			this->glyphs[g].w = w;
+			this->glyphs[g].h = rendered[g] != NULL ? rendered[g]->h : 0;
+			penX += w;
+		}
+
+		SDL_Surface* atlas = SDL_CreateRGBSurfaceWithFormat(0, atlasWidth, penY + this->lineHeight, 32, SDL_PIXELFORMAT_ARGB8888);
+		for (int g=0;g<=lastChar - firstChar;g++)
+		{
+			if (rendered[g] == NULL)
+				continue;
+			//Copy the coverage into the atlas rather than blending it onto nothing
+			SDL_SetSurfaceBlendMode(rendered[g], SDL_BLENDMODE_NONE);
+			SDL_BlitSurface(rendered[g], NULL, atlas, &this->glyphs[g]);
+			SDL_FreeSurface(rendered[g]);
+		}
+
+		this->texture = SDL_CreateTextureFromSurface(ren, atlas);
+		SDL_SetTextureBlendMode(this->texture, SDL_BLENDMODE_BLEND);
+		SDL_FreeSurface(atlas);
+	}
+
+	~GlyphAtlas()
+	{
+		if (this->texture != NULL)
+			SDL_DestroyTexture(this->texture);
+	}
+
+	int getGlyph(char c)
+	{
+		if (c < firstChar || c > lastChar)
+			c = '?';
+		return c - firstChar;
+	}
+
+	int measure(const string& text)
+	{
+		int width = 0;
+		for (int i=0;i<text.size();i++)
+			width += this->advances[this->getGlyph(text[i])];
+		return width;
+	}
+
+	//Draws text with its top left corner at x, y
+	void draw(SDL_Renderer* ren, const string& text, int x, int y, SDL_Color color)
+	{
+		if (this->texture == NULL)
+			return;
+
+		SDL_SetTextureColorMod(this->texture, color.r, color.g, color.b);
+		int penX = x;
+		for (int i=0;i<text.size();i++)
+		{
+			int g = this->getGlyph(text[i]);
+			SDL_Rect dest;
+			dest.x = penX;
+			dest.y = y;
+			dest.w = this->glyphs[g].w;
+			dest.h = this->glyphs[g].h;
+			SDL_RenderCopy(ren, this->texture, &this->glyphs[g], &dest);
+			penX += this->advances[g];
+		}
+	}
+};
+
+//One atlas per renderer and font size
+map<pair<SDL_Renderer*, int>, GlyphAtlas*> glyphAtlasCache;
+
+GlyphAtlas* getGlyphAtlas(SDL_Renderer* ren, int size)
+{
+	pair<SDL_Renderer*, int> key(ren, size);
+	map<pair<SDL_Renderer*, int>, GlyphAtlas*>::iterator it = glyphAtlasCache.find(key);
+	if (it != glyphAtlasCache.end())
+		return it->second;
+
+	GlyphAtlas* atlas = new GlyphAtlas(ren, getFont(size));
+	glyphAtlasCache[key] = atlas;
+	return atlas;
+}
+
+//Has to run before TTF_Quit and before the renderers are destroyed
+void closeTextCache()
+{
+	for (map<pair<SDL_Renderer*, int>, GlyphAtlas*>::iterator it = glyphAtlasCache.begin(); it != glyphAtlasCache.end(); ++it)
+		delete it->second;
+	glyphAtlasCache.clear();
+
+	for (map<int, TTF_Font*>::iterator it = fontCache.begin(); it != fontCache.end(); ++it)
+		if (it->second != NULL)
+			TTF_CloseFont(it->second);
+	fontCache.clear();
+}
+
+#endif
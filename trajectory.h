@@ -0,0 +1,638 @@
+#ifndef TRAJECTORY_H
+#define TRAJECTORY_H
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include "nbody.h"
+#include "compress.h"
+
+using namespace std;
+
+//Trajectory files (.nbt) record the live bodies every few steps, one chunk per recorded step:
+//	header		8 byte magic "NBTRAJ1\0"
+//	chunks		32 byte chunk header {magic, uint32 count, uint64 step, double time, uint64 chunk bytes}
+//				then with magic "NBCK" count x, count y, count velX and count velY doubles and count uint32 body ids,
+//				or with magic "NBX" or "NBQ" and 'K' or 'D' a FrameCodec payload (compress.h) in xor or quantized mode
+//				coded from scratch ('K', a keyframe) or against the chunks since the last keyframe ('D'). Zero padded to 8 bytes
+//	index		one 32 byte entry {uint64 step, double time, uint64 chunk offset, uint32 count, uint16 compression, uint16 keyframe} per chunk
+//	footer		{uint64 index offset, uint64 chunk count, 8 byte magic "NBTRIDX1"}
+//Chunks are only ever appended, the index is written once when recording stops so readers can seek straight to any step
+//A file whose recording never stopped cleanly has no index, readers rebuild it by walking the chunk headers
+//Everything is stored in the machine's byte order, which is little endian everywhere this runs
+const char trajectoryMagic[8] = {'N', 'B', 'T', 'R', 'A', 'J', '1', 0};
+const char trajectoryChunkMagic[4] = {'N', 'B', 'C', 'K'};
+const char trajectoryIndexMagic[8] = {'N', 'B', 'T', 'R', 'I', 'D', 'X', '1'};
+const int trajectoryChunkHeaderSize = 32;
+const int trajectoryFooterSize = 24;
+
+struct TrajectoryIndexEntry
+{
+	uint64_t step;
+	double time;
+	uint64_t offset;
+	uint32_t count;
+	uint16_t compression;
+	uint16_t keyframe;
+};
+
+//One recorded step as columns, body i of the step is ids[i], x[i], y[i] and so on
+struct TrajectoryFrame
+{
+	uint64_t step = 0;
+	double time = 0;
+	vector<uint32_t> ids;
+	vector<double> x;
+	vector<double> y;
+	vector<double> velX;
+	vector<double> velY;
+};
+
+//fseek takes a long, which is 32 bits on Windows
+bool seekFile(FILE* file, int64_t offset, int origin = SEEK_SET)
+{
+#ifdef _WIN32
+	return _fseeki64(file, offset, origin) == 0;
+#else
+	return fseeko(file, offset, origin) == 0;
+#endif
+}
+
+void getChunkMagic(int compression, bool keyframe, char* magic)
+{
+	if (compression == COMPRESSION_NONE)
+	{
+		memcpy(magic, trajectoryChunkMagic, 4);
+		return;
+	}
+	magic[0] = 'N';
+	magic[1] = 'B';
+	magic[2] = compression == COMPRESSION_QUANTIZED ? 'Q' : 'X';
+	magic[3] = keyframe ? 'K' : 'D';
+}
+
+bool parseChunkMagic(const char* magic, int* compression, bool* keyframe)
+{
+	*keyframe = true;
+	*compression = COMPRESSION_NONE;
+	if (memcmp(magic, trajectoryChunkMagic, 4) == 0)
+		return true;
+	if (magic[0] != 'N' || magic[1] != 'B' || (magic[2] != 'X' && magic[2] != 'Q') || (magic[3] != 'K' && magic[3] != 'D'))
+		return false;
+	*compression = magic[2] == 'Q' ? COMPRESSION_QUANTIZED : COMPRESSION_XOR;
+	*keyframe = magic[3] == 'K';
+	return true;
+}
+
+size_t getTrajectoryChunkSize(int count)
+{
+	size_t bytes = trajectoryChunkHeaderSize + (4*sizeof(double) + sizeof(uint32_t))*count;
+	return (bytes + 7)/8*8;
+}
+
+//Appends a chunk per recorded step to a new trajectory file and writes the index on close
+class TrajectoryWriter
+{
+public:
+	FILE* file = NULL;
+	string path;
+	uint64_t offset = 0;
+	vector<TrajectoryIndexEntry> index;
+	uint64_t bytesWritten = 0;
+	//What the chunks would have taken uncompressed, for the compression ratio
+	uint64_t rawBytes = 0;
+	//Each chunk is put together here first and written with a single call
+	vector<char> chunk;
+	int compression = COMPRESSION_NONE;
+	//Every keyframeEvery-th compressed chunk is a keyframe, the most chunks a reader has to decode to reach any step
+	int keyframeEvery = 32;
+	FrameCodec codec;
+	vector<char> payload;
+	//Set when the codec's history no longer matches the file, the next compressed chunk has to be a keyframe
+	bool restart = true;
+
+	//Takes effect from the next chunk, which is made a keyframe, quantized needs a maxError above 0 and is lossless xor without one
+	void setCompression(int mode, double maxError)
+	{
+		if (mode == COMPRESSION_QUANTIZED && maxError <= 0)
+			mode = COMPRESSION_XOR;
+		this->compression = mode;
+		this->codec.mode = mode;
+		this->codec.maxError = maxError;
+		this->restart = true;
+	}
+
+	~TrajectoryWriter()
+	{
+		this->close();
+	}
+
+	bool isOpen()
+	{
+		return this->file != NULL;
+	}
+
+	bool open(const string& argPath)
+	{
+		this->close();
+		this->path = argPath;
+		this->file = fopen(argPath.c_str(), "wb");
+		if (this->file == NULL)
+		{
+			std::cout << "Couldn't open " << argPath << " for writing\n";
+			return false;
+		}
+
+		//Chunks are already one large block each, stdio buffering would only add a copy
+		setvbuf(this->file, NULL, _IONBF, 0);
+		this->index.clear();
+		this->offset = 0;
+		this->bytesWritten = 0;
+		this->rawBytes = 0;
+		this->restart = true;
+		return this->write(trajectoryMagic, sizeof(trajectoryMagic));
+	}
+
+	//Records the live bodies of list as the state after step steps
+	bool writeFrame(const vector<nbody>& list, uint64_t step)
+	{
+		if (this->file == NULL)
+			return false;
+
+		//Live bodies are counted per chunk first so every chunk knows where its bodies go in the columns
+		int n = list.size();
+		int chunkCount = getParallelChunkCount(n);
+		vector<int> firstLive(chunkCount + 1, 0);
+		parallelFor(n, [&](int c, int start, int stop)
+		{
+			int live = 0;
+			for (int i=start;i<stop;i++)
+				live += !list[i].dead;
+			firstLive[c + 1] = live;
+		});
+		for (int c=0;c<chunkCount;c++)
+			firstLive[c + 1] += firstLive[c];
+		int count = firstLive[chunkCount];
+
+		size_t chunkBytes = getTrajectoryChunkSize(count);
+		this->chunk.resize(chunkBytes);
+		char* data = this->chunk.data();
+		double time = step*timeStep;
+		uint32_t count32 = count;
+		uint64_t chunkBytes64 = chunkBytes;
+		memcpy(data, trajectoryChunkMagic, 4);
+		memcpy(data + 4, &count32, 4);
+		memcpy(data + 8, &step, 8);
+		memcpy(data + 16, &time, 8);
+		memcpy(data + 24, &chunkBytes64, 8);
+
+		double* x = (double*)(data + trajectoryChunkHeaderSize);
+		double* y = x + count;
+		double* velX = y + count;
+		double* velY = velX + count;
+		uint32_t* ids = (uint32_t*)(velY + count);
+		parallelFor(n, [&](int c, int start, int stop)
+		{
+			int out = firstLive[c];
+			for (int i=start;i<stop;i++)
+			{
+				const nbody& curBody = list[i];
+				if (curBody.dead)
+					continue;
+				x[out] = curBody.x;
+				y[out] = curBody.y;
+				velX[out] = curBody.velX;
+				velY[out] = curBody.velY;
+				ids[out] = curBody.id;
+				out++;
+			}
+		});
+		char* padding = (char*)(ids + count);
+		memset(padding, 0, data + chunkBytes - padding);
+
+		TrajectoryIndexEntry entry;
+		entry.step = step;
+		entry.time = time;
+		entry.offset = this->offset;
+		entry.count = count;
+		entry.compression = this->compression;
+		entry.keyframe = 1;
+		this->rawBytes += chunkBytes;
+
+		if (this->compression == COMPRESSION_NONE)
+		{
+			if (!this->write(data, chunkBytes))
+				return false;
+		}
+		else
+		{
+			int sinceKeyframe = 0;
+			for (int f=this->index.size()-1;f>=0 && !this->index[f].keyframe;f--)
+				sinceKeyframe++;
+			bool keyframe = this->restart || sinceKeyframe + 1 >= this->keyframeEvery;
+			this->restart = false;
+			entry.keyframe = keyframe;
+
+			const double* columns[frameColumns] = {x, y, velX, velY};
+			this->codec.encode(ids, columns, count, keyframe, &this->payload);
+			uint64_t packedBytes = (trajectoryChunkHeaderSize + this->payload.size() + 7)/8*8;
+			this->payload.resize(packedBytes - trajectoryChunkHeaderSize, 0);
+			getChunkMagic(this->compression, keyframe, data);
+			memcpy(data + 24, &packedBytes, 8);
+			if (!this->write(data, trajectoryChunkHeaderSize) || !this->write(this->payload.data(), this->payload.size()))
+				return false;
+		}
+		this->index.push_back(entry);
+		return true;
+	}
+
+	//Writes the index and footer, the file is complete once this returns
+	void close()
+	{
+		if (this->file == NULL)
+			return;
+
+		uint64_t indexOffset = this->offset;
+		uint64_t frameCount = this->index.size();
+		if (this->write(this->index.data(), sizeof(TrajectoryIndexEntry)*this->index.size()))
+		{
+			char footer[trajectoryFooterSize];
+			memcpy(footer, &indexOffset, 8);
+			memcpy(footer + 8, &frameCount, 8);
+			memcpy(footer + 16, trajectoryIndexMagic, 8);
+			this->write(footer, sizeof(footer));
+		}
+
+		if (this->file != NULL)
+			fclose(this->file);
+		this->file = NULL;
+	}
+
+	//Gives up on the file on a failed write, what was written before stays readable through the chunk headers
+	bool write(const void* data, size_t bytes)
+	{
+		if (fwrite(data, 1, bytes, this->file) != bytes)
+		{
+			std::cout << "Couldn't write to " << this->path << ", trajectory recording stopped\n";
+			fclose(this->file);
+			this->file = NULL;
+			return false;
+		}
+
+		this->offset += bytes;
+		this->bytesWritten += bytes;
+		return true;
+	}
+};
+
+//Records trajectory frames through a TrajectoryWriter on its own thread, so recording a frame only costs the caller a copy
+//of the bodies and the transposing, compressing and writing overlap the simulation. Staging is double buffered: one copy is
+//written while the next waits, and only a third frame arriving before the first is done has to wait, frames are never dropped
+class TrajectoryRecorder
+{
+public:
+	struct Request
+	{
+		vector<nbody> bodies;
+		uint64_t step;
+	};
+
+	//Frames that can wait behind the one being written
+	int maxPending = 1;
+
+	TrajectoryRecorder()
+	{
+		this->worker = thread(&TrajectoryRecorder::run, this);
+	}
+
+	//Writes whatever is still queued and finishes the file before returning
+	~TrajectoryRecorder()
+	{
+		this->close();
+		{
+			lock_guard<mutex> guard(this->lock);
+			this->stopping = true;
+		}
+		this->wake.notify_all();
+		this->worker.join();
+	}
+
+	void setCompression(int mode, double maxError)
+	{
+		unique_lock<mutex> guard(this->lock);
+		this->waitUntilIdle(guard);
+		this->writer.setCompression(mode, maxError);
+	}
+
+	bool open(const string& path)
+	{
+		unique_lock<mutex> guard(this->lock);
+		this->waitUntilIdle(guard);
+		this->recording = this->writer.open(path);
+		this->frameCount = 0;
+		return this->recording;
+	}
+
+	bool isOpen()
+	{
+		lock_guard<mutex> guard(this->lock);
+		return this->recording;
+	}
+
+	//Frames recorded since the file was opened, counting ones still being written
+	int getFrameCount()
+	{
+		lock_guard<mutex> guard(this->lock);
+		return this->frameCount;
+	}
+
+	//Queues the live bodies of list to be recorded as the state after step steps
+	void record(const vector<nbody>& list, uint64_t step)
+	{
+		{
+			unique_lock<mutex> guard(this->lock);
+			this->idle.wait(guard, [this]() { return this->pending.size() < this->maxPending || !this->recording; });
+			if (!this->recording)
+				return;
+			Request request;
+			if (this->spare.size() > 0)
+			{
+				request = move(this->spare.back());
+				this->spare.pop_back();
+			}
+			request.bodies.resize(list.size());
+			if (list.size() > 0)
+				memcpy(request.bodies.data(), list.data(), sizeof(nbody)*list.size());
+			request.step = step;
+			this->pending.push_back(move(request));
+			this->frameCount++;
+		}
+		this->wake.notify_all();
+	}
+
+	//Blocks until every frame recorded so far is written, then writes the index and closes the file
+	void close()
+	{
+		unique_lock<mutex> guard(this->lock);
+		this->waitUntilIdle(guard);
+		if (this->writer.isOpen())
+			this->writer.close();
+		this->recording = false;
+	}
+
+private:
+	//Only the worker touches the writer while it is busy, everything else waits until it's idle
+	TrajectoryWriter writer;
+	mutex lock;
+	condition_variable wake;
+	condition_variable idle;
+	deque<Request> pending;
+	vector<Request> spare;
+	bool writing = false;
+	bool stopping = false;
+	bool recording = false;
+	int frameCount = 0;
+	thread worker;
+
+	void waitUntilIdle(unique_lock<mutex>& guard)
+	{
+		this->idle.wait(guard, [this]() { return this->pending.size() == 0 && !this->writing; });
+	}
+
+	void run()
+	{
+		while (true)
+		{
+			Request request;
+			{
+				unique_lock<mutex> guard(this->lock);
+				this->wake.wait(guard, [this]() { return this->pending.size() > 0 || this->stopping; });
+				if (this->pending.size() == 0)
+					return;
+				request = move(this->pending.front());
+				this->pending.pop_front();
+				this->writing = true;
+			}
+			//The staging buffer it came from is free for the next frame as soon as it's taken
+			this->idle.notify_all();
+
+			bool written = this->writer.writeFrame(request.bodies, request.step);
+
+			{
+				lock_guard<mutex> guard(this->lock);
+				//A failed write has already closed the file, frames still queued have nowhere to go
+				if (!written)
+				{
+					this->recording = false;
+					this->pending.clear();
+				}
+				this->spare.push_back(move(request));
+				this->writing = false;
+			}
+			this->idle.notify_all();
+		}
+	}
+};
+
+class TrajectoryReader
+{
+public:
+	FILE* file = NULL;
+	vector<TrajectoryIndexEntry> index;
+	//Compressed chunks are decoded in order from their keyframe, reading the frame after the last one read only decodes one chunk
+	FrameCodec codec;
+	int decodedFrame = -1;
+	vector<char> payload;
+
+	~TrajectoryReader()
+	{
+		if (this->file != NULL)
+			fclose(this->file);
+	}
+
+	bool open(const string& path)
+	{
+		if (this->file != NULL)
+			fclose(this->file);
+		this->index.clear();
+		this->decodedFrame = -1;
+		this->file = fopen(path.c_str(), "rb");
+		if (this->file == NULL)
+		{
+			std::cout << "Couldn't open " << path << "\n";
+			return false;
+		}
+
+		char magic[8];
+		if (fread(magic, 1, 8, this->file) != 8 || memcmp(magic, trajectoryMagic, 8) != 0)
+		{
+			std::cout << path << " isn't a trajectory file\n";
+			fclose(this->file);
+			this->file = NULL;
+			return false;
+		}
+
+		if (!this->readIndex())
+			this->rebuildIndex();
+		return true;
+	}
+
+	int getFrameCount()
+	{
+		return this->index.size();
+	}
+
+	//Last frame recorded at or before step, or -1 if recording started after it
+	int findFrame(uint64_t step)
+	{
+		int low = 0;
+		int high = this->index.size();
+		while (low < high)
+		{
+			int mid = (low + high)/2;
+			if (this->index[mid].step <= step)
+				low = mid + 1;
+			else
+				high = mid;
+		}
+		return low - 1;
+	}
+
+	bool readFrame(int frame, TrajectoryFrame* result)
+	{
+		if (frame < 0 || frame >= this->index.size())
+			return false;
+
+		const TrajectoryIndexEntry& entry = this->index[frame];
+		int count = entry.count;
+		result->step = entry.step;
+		result->time = entry.time;
+		result->x.resize(count);
+		result->y.resize(count);
+		result->velX.resize(count);
+		result->velY.resize(count);
+		result->ids.resize(count);
+		if (entry.compression != COMPRESSION_NONE)
+			return this->decodeFrame(frame, result);
+		if (!seekFile(this->file, entry.offset + trajectoryChunkHeaderSize))
+			return false;
+		return fread(result->x.data(), sizeof(double), count, this->file) == count
+			&& fread(result->y.data(), sizeof(double), count, this->file) == count
+			&& fread(result->velX.data(), sizeof(double), count, this->file) == count
+			&& fread(result->velY.data(), sizeof(double), count, this->file) == count
+			&& fread(result->ids.data(), sizeof(uint32_t), count, this->file) == count;
+	}
+
+	bool decodeFrame(int frame, TrajectoryFrame* result)
+	{
+		int start = frame;
+		while (start > 0 && !this->index[start].keyframe)
+			start--;
+		if (this->decodedFrame >= start && this->decodedFrame < frame)
+			start = this->decodedFrame + 1;
+
+		double* columns[frameColumns] = {result->x.data(), result->y.data(), result->velX.data(), result->velY.data()};
+		vector<uint32_t> skippedIds;
+		vector<double> skipped[frameColumns];
+		for (int f=start;f<=frame;f++)
+		{
+			const TrajectoryIndexEntry& entry = this->index[f];
+			char header[trajectoryChunkHeaderSize];
+			uint64_t chunkBytes;
+			if (!seekFile(this->file, entry.offset) || fread(header, 1, sizeof(header), this->file) != sizeof(header))
+				break;
+			memcpy(&chunkBytes, header + 24, 8);
+			this->payload.resize(chunkBytes - trajectoryChunkHeaderSize);
+			if (fread(this->payload.data(), 1, this->payload.size(), this->file) != this->payload.size())
+				break;
+
+			//Frames on the way to the one asked for are decoded into scratch columns
+			uint32_t* ids = result->ids.data();
+			double* const* into = columns;
+			double* scratch[frameColumns];
+			if (f < frame)
+			{
+				skippedIds.resize(entry.count);
+				for (int c=0;c<frameColumns;c++)
+				{
+					skipped[c].resize(entry.count);
+					scratch[c] = skipped[c].data();
+				}
+				ids = skippedIds.data();
+				into = scratch;
+			}
+
+			if (!this->codec.decode(this->payload.data(), this->payload.size(), entry.count, entry.keyframe, ids, into))
+				break;
+			this->decodedFrame = f;
+		}
+
+		if (this->decodedFrame != frame)
+		{
+			this->decodedFrame = -1;
+			return false;
+		}
+		return true;
+	}
+
+	bool readIndex()
+	{
+		char footer[trajectoryFooterSize];
+		if (!seekFile(this->file, -trajectoryFooterSize, SEEK_END) || fread(footer, 1, sizeof(footer), this->file) != sizeof(footer) || memcmp(footer + 16, trajectoryIndexMagic, 8) != 0)
+			return false;
+
+		uint64_t indexOffset, frameCount;
+		memcpy(&indexOffset, footer, 8);
+		memcpy(&frameCount, footer + 8, 8);
+		this->index.resize(frameCount);
+		if (!seekFile(this->file, indexOffset) || fread(this->index.data(), sizeof(TrajectoryIndexEntry), frameCount, this->file) != frameCount)
+		{
+			this->index.clear();
+			return false;
+		}
+		return true;
+	}
+
+	//Walks the chunk headers from the start, stopping at the first one that is missing or cut short
+	void rebuildIndex()
+	{
+		uint64_t offset = sizeof(trajectoryMagic);
+		char header[trajectoryChunkHeaderSize];
+		int compression;
+		bool keyframe;
+		while (seekFile(this->file, offset) && fread(header, 1, sizeof(header), this->file) == sizeof(header) && parseChunkMagic(header, &compression, &keyframe))
+		{
+			TrajectoryIndexEntry entry;
+			uint64_t chunkBytes;
+			memcpy(&entry.count, header + 4, 4);
+			memcpy(&entry.step, header + 8, 8);
+			memcpy(&entry.time, header + 16, 8);
+			memcpy(&chunkBytes, header + 24, 8);
+			entry.offset = offset;
+			entry.compression = compression;
+			entry.keyframe = keyframe;
+			if (compression == COMPRESSION_NONE ? chunkBytes != getTrajectoryChunkSize(entry.count) : chunkBytes < trajectoryChunkHeaderSize + 16)
+				break;
+			//A delta chunk can't be decoded without the ones before it
+			if (!keyframe && (this->index.size() == 0 || this->index.back().compression != compression))
+				break;
+
+			//The last chunk may not have made it to disk in full
+			char last;
+			if (!seekFile(this->file, offset + chunkBytes - 1) || fread(&last, 1, 1, this->file) != 1)
+				break;
+
+			this->index.push_back(entry);
+			offset += chunkBytes;
+		}
+	}
+};
+
+#endif